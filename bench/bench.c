@@ -0,0 +1,1105 @@
+/*** includes ***/
+
+#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <pty.h>	/* forkpty() runs kilo on a terminal of its own. */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>	/* for the peak memory of a finished kilo. */
+#include <sys/ptrace.h>	/* for counting the system calls kilo makes. */
+
+/* Run kilo under a pseudo-terminal, feed it scripts of keys, and time how long each key takes to show up on the
+ * screen. kilo has to be built with -DKILO_BENCH, which ends every frame with a mark saying how much input it has
+ * read and how many bytes the frame took, see refresh_screen(). For every file size and script we write out:
+ *
+ *   latency_us          time from writing a key to the first frame that answers it, as percentiles.
+ *   frame_bytes         bytes refresh_screen() wrote for a key, the frames drawn after it by other threads included.
+ *   syscalls_per_key    system calls made by all of kilo's threads for a key, counted in a second, traced run.
+ *   peak_rss_kb         most memory kilo had at once, the pages of the file it has mapped included.
+ *   peak_anon_kb        most memory kilo had allocated itself, sampled from /proc while it runs.
+ *
+ * Besides files of many lines there are files of a single line of each of WIDTHS characters, which are typed
+ * into in the middle.
+ *
+ * The eof script is run on every file: it searches for the text of the last line, which the match counting
+ * thread has to go through the whole file for, types a character at the end of that line and saves. Keys that
+ * start work in the background are only answered by the first frame drawn once kilo says it is all done, and the
+ * saved file has to have grown by that character. -m and -t make any run that took more than MAX_RSS_MB megabytes
+ * of memory of its own on top of the length of its longest line, which kilo has to hold to edit it, or MAX_MS
+ * milliseconds for its slowest 1% of keys, count as a failure. -r only runs the SCRIPTS named.
+ *
+ * Last, kilo -s times how fast kilo gets through a file of SCAN_MB megabytes without a terminal, and we write out
+ * its GB/s as throughput_gbps:
+ *
+ *   index               finding where the lines start, on 1, 2, 4 and 8 threads.
+ *   literal             finding all the matches of some text, the way the match counting thread does.
+ *   regex               the same for a regex.
+ *
+ * With -c the benchmarks aren't run, instead the checks are: keys are typed into kilo and saved, and the file is
+ * compared with what it should say afterwards. A script is also run on two files with kilo -b, without a terminal,
+ * and kilo is killed before it saves to see the journal bring back what was typed.
+ *
+ * Usage: bench [-k KILO] [-o OUT.json] [-l LINES,...] [-w WIDTHS,...] [-g SCAN_MB] [-r SCRIPTS,...]
+ *              [-m MAX_RSS_MB] [-t MAX_MS] [-c]
+ */
+
+/*** defines ***/
+
+#define BENCH_ROWS 24
+#define BENCH_COLS 80
+#define BENCH_TIMEOUT 30000	/* milliseconds to wait for a frame before giving up on kilo. */
+#define BENCH_IDLE_TIMEOUT 600000	/* milliseconds to wait for kilo to be done with a key in the background. */
+#define BENCH_TYPE_KEYS 1000
+#define BENCH_PAGE_KEYS 200
+#define BENCH_SEARCHES 10
+#define BENCH_PASTES 20
+#define BENCH_PASTE_LINES 200
+#define BENCH_LONG_KEYS 500
+#define BENCH_LINE_BYTES 28	/* about how long the lines gen_file() writes are. */
+
+/*** data ***/
+
+/* the keys of a script, one after the other in buf. */
+typedef struct keys {
+	char *buf;
+	size_t len;
+	size_t cap;
+	size_t *end;	/* end[i] is where the i'th key ends in buf. */
+	unsigned char *idle;	/* idle[i] is set if the i'th key is only answered once kilo is done with it in the background. */
+	size_t n;
+	size_t nend;
+	size_t setup;	/* keys at the start that only get kilo ready, they aren't timed. */
+	int saves;	/* the keys end by saving the file, which has to have grown by grows bytes then. */
+	size_t grows;
+} keys;
+
+/* a kilo running on a pseudo-terminal. */
+typedef struct run {
+	pid_t pid;
+	int fd;	/* our side of the terminal. */
+	char carry[64];	/* the start of a mark the last read cut in two. */
+	size_t carrylen;
+	size_t answered;	/* input kilo had read by its last frame. */
+	int busy;	/* kilo was still searching, replacing or saving in the background at its last frame. */
+	size_t frames;
+	long anon_kb;	/* most memory kilo had allocated itself when it was looked at. */
+	long sampled;	/* when it was last looked at, in microseconds. */
+	keys *k;
+	size_t key;	/* key the frames being read answer. */
+	size_t *bytes;	/* bytes of frames per key. */
+} run;
+
+/* a traced run, the thread that starts kilo has to be the one tracing it. */
+typedef struct trace {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	const char *kilo;
+	const char *file;
+	pid_t pid;
+	int fd;
+	int started;
+	unsigned long stops;	/* times a thread of kilo stopped going into or out of a system call. */
+} trace;
+
+typedef struct result {
+	const char *script;
+	size_t lines;
+	size_t width;	/* characters in the line of a one line file, 0 for the others. */
+	size_t nkeys;
+	double open_ms;
+	long p50, p90, p99, max;
+	double bytes_mean;
+	size_t bytes_max;
+	double syscalls;	/* -1 if kilo couldn't be traced. */
+	long rss_kb;
+	long anon_kb;
+} result;
+
+/* a file, the keys typed into it that end by saving it, and what it should say then. */
+typedef struct check {
+	const char *name;
+	const char *text;
+	const char *keys[16];	/* one key or a string typed at once each, up to a NULL. */
+	const char *want;
+} check;
+
+/* a line of what kilo -s prints. */
+typedef struct throughput {
+	char what[16];
+	int threads;
+	double gbps;
+} throughput;
+
+/*** declarations ***/
+
+long now_us(void);
+int gen_file(const char *, size_t);
+int gen_line(const char *, size_t);
+void keys_add(keys *, const char *, size_t);
+void keys_idle(keys *);
+void keys_free(keys *);
+void script_type(keys *, size_t);
+void script_page(keys *, size_t);
+void script_search(keys *, size_t);
+void script_paste(keys *, size_t);
+void script_long(keys *, size_t);
+void script_find_end(keys *, const char *);
+void script_eof(keys *, size_t);
+void script_eof_long(keys *, size_t);
+void kilo_exec(const char *, const char *);
+pid_t kilo_spawn(const char *, const char *, int *);
+void run_mark(run *, size_t, size_t, int);
+void run_sample(run *);
+int run_read(run *, int);
+int run_send(run *, const char *, size_t);
+int run_until(run *, size_t);
+int run_idle(run *, size_t);
+int run_key(run *, keys *, size_t);
+void run_stop(run *, struct rusage *);
+void *trace_thread(void *);
+int lat_cmp(const void *, const void *);
+long percentile(long *, size_t, int);
+int bench_script(const char *, const char *, size_t, const char *, keys *, result *);
+int script_wanted(const char *, const char *);
+int over_budget(result *, long, long);
+void journal_path(const char *, char *, size_t);
+long journal_size(const char *);
+void remove_journal(const char *);
+int bench_scan(const char *, const char *, throughput **, size_t *);
+int write_file(const char *, const char *);
+int wait_file(run *, const char *, const char *);
+int run_check(const char *, const char *, check *);
+int check_batch(const char *, const char *);
+int check_journal(const char *, const char *);
+void write_json(FILE *, const char *, result *, size_t, throughput *, size_t);
+
+/*** keys ***/
+
+long now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* write a file of lines lines that look a bit like C. */
+int gen_file(const char *path, size_t lines)
+{
+	FILE *fp = fopen(path, "w");
+	if (fp == NULL) return -1;
+	size_t i;
+	for (i = 0; i < lines; i++) {
+		if (i % 10 == 0) fprintf(fp, "/* block %zu of the benchmark file. */\n", i / 10);
+		else fprintf(fp, "\tint v%zu = %zu; \"s%zu\"\n", i, i * 7, i % 97);
+	}
+	return fclose(fp);
+}
+
+/* write a file of a single line of about width characters, with MIDDLE in the middle of it and LAST at its end. */
+int gen_line(const char *path, size_t width)
+{
+	FILE *fp = fopen(path, "w");
+	if (fp == NULL) return -1;
+	size_t len = 0, i = 0;
+	int middle = 0;
+	while (len + 4 < width) {
+		if (!middle && len >= width / 2) {
+			len += fprintf(fp, "MIDDLE ");
+			middle = 1;
+		} else if (i % 50 == 49) {
+			len += fprintf(fp, "\t/* %zu */ ", i);
+		} else {
+			len += fprintf(fp, "v%zu = \"s%zu\"; ", i, i % 97);
+		}
+		i++;
+	}
+	fputs("LAST\n", fp);
+	return fclose(fp);
+}
+
+void keys_add(keys *k, const char *s, size_t len)
+{
+	if (k->len + len > k->cap) {
+		k->cap = (k->len + len) * 2;
+		k->buf = realloc(k->buf, k->cap);
+	}
+	if (k->n == k->nend) {
+		k->nend = k->nend ? k->nend * 2 : 256;
+		k->end = realloc(k->end, sizeof(size_t) * k->nend);
+		k->idle = realloc(k->idle, k->nend);
+	}
+	memcpy(&k->buf[k->len], s, len);
+	k->len += len;
+	k->idle[k->n] = 0;
+	k->end[k->n++] = k->len;
+}
+
+/* only take the last key added as answered once kilo has finished what it started in the background. */
+void keys_idle(keys *k)
+{
+	k->idle[k->n - 1] = 1;
+}
+
+void keys_free(keys *k)
+{
+	free(k->buf);
+	free(k->end);
+	free(k->idle);
+	memset(k, 0, sizeof(*k));
+}
+
+/* type lines of code at the top of the file, a key at a time. */
+void script_type(keys *k, size_t lines)
+{
+	(void) lines;
+	const char *line = "int x = 42; /* typed */";
+	size_t i, j = 0;
+	for (i = 0; i < BENCH_TYPE_KEYS; i++) {
+		if (line[j] == '\0') {
+			keys_add(k, "\r", 1);
+			j = 0;
+		} else {
+			keys_add(k, &line[j++], 1);
+		}
+	}
+}
+
+void script_page(keys *k, size_t lines)
+{
+	(void) lines;
+	size_t i;
+	for (i = 0; i < BENCH_PAGE_KEYS; i++) keys_add(k, "\x1b[6~", 4);
+}
+
+/* search for variables further and further into the file, the search moves on as each character is typed. */
+void script_search(keys *k, size_t lines)
+{
+	size_t i;
+	for (i = 1; i <= BENCH_SEARCHES; i++) {
+		char query[32];
+		int len = snprintf(query, sizeof(query), "v%zu ", lines * i / (BENCH_SEARCHES + 1));
+		int j;
+		keys_add(k, "\x06", 1);
+		for (j = 0; j < len; j++) keys_add(k, &query[j], 1);
+		keys_add(k, "\r", 1);
+	}
+}
+
+/* paste blocks of lines, each paste is a key. */
+void script_paste(keys *k, size_t lines)
+{
+	(void) lines;
+	size_t cap = BENCH_PASTE_LINES * 64 + 16;
+	char *paste = malloc(cap);
+	size_t i, len;
+	for (i = 0; i < BENCH_PASTES; i++) {
+		size_t j;
+		len = 0;
+		len += snprintf(&paste[len], cap - len, "\x1b[200~");
+		for (j = 0; j < BENCH_PASTE_LINES; j++)
+			len += snprintf(&paste[len], cap - len, "\tpasted(%zu, %zu);\n", i, j);
+		len += snprintf(&paste[len], cap - len, "\x1b[201~");
+		keys_add(k, paste, len);
+	}
+	free(paste);
+}
+
+/* go to the middle of a long line and type there, taking a character back now and then. */
+void script_long(keys *k, size_t width)
+{
+	(void) width;
+	const char *find = "\x06MIDDLE\r";
+	size_t i;
+	for (i = 0; find[i]; i++) keys_add(k, &find[i], 1);
+	k->setup = k->n;
+
+	const char *text = "x = 42; ";
+	for (i = 0; i < BENCH_LONG_KEYS; i++) {
+		if (i % 5 == 4) keys_add(k, "\x7f", 1);
+		else keys_add(k, &text[i % 8], 1);
+	}
+}
+
+/* search for query, which is only on the last line, type a character at the end of that line and save. */
+void script_find_end(keys *k, const char *query)
+{
+	size_t i;
+	keys_add(k, "\x06", 1);
+	for (i = 0; query[i]; i++) keys_add(k, &query[i], 1);
+	/* the cursor only moves to the match once the whole file has been searched. */
+	keys_idle(k);
+	keys_add(k, "\r", 1);
+	keys_add(k, "\x1b[F", 3);
+	keys_add(k, "x", 1);
+	keys_add(k, "\x13", 1);
+	keys_idle(k);
+	k->saves = 1;
+	k->grows = 1;
+}
+
+void script_eof(keys *k, size_t lines)
+{
+	/* text only the last line gen_file() writes has. */
+	char query[64];
+	size_t last = lines - 1;
+	if (last % 10 == 0) snprintf(query, sizeof(query), "block %zu ", last / 10);
+	else snprintf(query, sizeof(query), "v%zu ", last);
+	script_find_end(k, query);
+}
+
+void script_eof_long(keys *k, size_t width)
+{
+	(void) width;
+	script_find_end(k, "LAST");
+}
+
+/*** kilo ***/
+
+void kilo_exec(const char *kilo, const char *file)
+{
+	setenv("TERM", "xterm", 1);
+	execl(kilo, kilo, file, (char *) NULL);
+	perror(kilo);
+	_exit(127);
+}
+
+pid_t kilo_spawn(const char *kilo, const char *file, int *fd)
+{
+	struct winsize ws = { BENCH_ROWS, BENCH_COLS, 0, 0 };
+	pid_t pid = forkpty(fd, NULL, NULL, &ws);
+	if (pid == 0) kilo_exec(kilo, file);
+	if (pid != -1) fcntl(*fd, F_SETFL, O_NONBLOCK);
+	return pid;
+}
+
+/* a frame of bytes bytes answering the first input bytes of input, drawn while kilo was busy or not. */
+void run_mark(run *r, size_t input, size_t bytes, int busy)
+{
+	r->answered = input;
+	r->busy = busy;
+	r->frames++;
+	if (r->k == NULL || input < r->k->end[0]) return;	/* drawn before the first key. */
+	while (r->key + 1 < r->k->n && r->k->end[r->key + 1] <= input) r->key++;
+	r->bytes[r->key] += bytes;
+}
+
+/* look at how much memory kilo has allocated itself, at most every 10 milliseconds. Pages of the files it maps
+ * aren't counted, the kernel can drop those whenever it likes.
+ */
+void run_sample(run *r)
+{
+	long now = now_us();
+	if (now - r->sampled < 10000) return;
+	r->sampled = now;
+
+	char path[64], line[256];
+	snprintf(path, sizeof(path), "/proc/%d/status", (int) r->pid);
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) return;
+	long kb;
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "RssAnon: %ld", &kb) == 1 && kb > r->anon_kb) r->anon_kb = kb;
+	}
+	fclose(fp);
+}
+
+/* read what kilo has drawn, waiting at most timeout milliseconds for it, return -1 if kilo is gone. */
+int run_read(run *r, int timeout)
+{
+	run_sample(r);
+	struct pollfd pfd = { r->fd, POLLIN, 0 };
+	if (poll(&pfd, 1, timeout) <= 0) return 0;
+
+	char buf[65536 + sizeof(r->carry)];
+	memcpy(buf, r->carry, r->carrylen);
+	ssize_t n = read(r->fd, &buf[r->carrylen], 65536);
+	if (n <= 0) return (n == -1 && errno == EAGAIN) ? 0 : -1;
+	size_t len = r->carrylen + n;
+	r->carrylen = 0;
+
+	/* frames end with ESC _ kilo;INPUT;BYTES;BUSY ESC \. */
+	size_t i = 0;
+	while (i < len) {
+		char *esc = memchr(&buf[i], '\x1b', len - i);
+		if (esc == NULL) break;
+		i = esc - buf;
+		char *end = memchr(&buf[i + 1], '\x1b', len - i - 1);
+		if (end == NULL || end + 1 == &buf[len]) {
+			/* the rest of the mark, if it is one, comes with the next read. */
+			if (len - i < sizeof(r->carry)) {
+				memcpy(r->carry, &buf[i], len - i);
+				r->carrylen = len - i;
+			}
+			break;
+		}
+		size_t input, bytes;
+		int busy;
+		if (end[1] == '\\' && sscanf(&buf[i], "\x1b_kilo;%zu;%zu;%d", &input, &bytes, &busy) == 3) {
+			run_mark(r, input, bytes, busy);
+			i = end - buf + 2;
+		} else {
+			i++;
+		}
+	}
+	return 1;
+}
+
+/* write len bytes of keys, reading frames meanwhile so neither side blocks the other. */
+int run_send(run *r, const char *s, size_t len)
+{
+	while (len > 0) {
+		struct pollfd pfd = { r->fd, POLLOUT, 0 };
+		poll(&pfd, 1, 10);
+		ssize_t n = write(r->fd, s, len);
+		if (n == -1 && errno != EAGAIN) return -1;
+		if (n > 0) {
+			s += n;
+			len -= n;
+		}
+		if (run_read(r, 0) == -1) return -1;
+	}
+	return 0;
+}
+
+/* wait until kilo has drawn a frame answering the first input bytes we sent. */
+int run_until(run *r, size_t input)
+{
+	long start = now_us();
+	while (r->frames == 0 || r->answered < input) {
+		if (run_read(r, 100) == -1) return -1;
+		if (now_us() - start > BENCH_TIMEOUT * 1000L) return -1;
+	}
+	return 0;
+}
+
+/* wait until kilo has drawn a frame answering the first input bytes we sent, with nothing left running. */
+int run_idle(run *r, size_t input)
+{
+	long start = now_us();
+	while (r->frames == 0 || r->answered < input || r->busy) {
+		if (run_read(r, 100) == -1) return -1;
+		if (now_us() - start > BENCH_IDLE_TIMEOUT * 1000L) return -1;
+	}
+	return 0;
+}
+
+/* send the i'th key of k and wait for kilo to answer it. */
+int run_key(run *r, keys *k, size_t i)
+{
+	size_t from = i ? k->end[i - 1] : 0;
+	if (run_send(r, &k->buf[from], k->end[i] - from) == -1) return -1;
+	return k->idle[i] ? run_idle(r, k->end[i]) : run_until(r, k->end[i]);
+}
+
+void run_stop(run *r, struct rusage *ru)
+{
+	int status;
+	kill(r->pid, SIGKILL);
+	if (ru) wait4(r->pid, &status, 0, ru);
+	close(r->fd);
+}
+
+/* start kilo traced, and keep it going while counting the system calls its threads stop at. */
+void *trace_thread(void *arg)
+{
+	trace *t = arg;
+	struct winsize ws = { BENCH_ROWS, BENCH_COLS, 0, 0 };
+	pid_t pid = forkpty(&t->fd, NULL, NULL, &ws);
+	if (pid == 0) {
+		ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+		raise(SIGSTOP);
+		kilo_exec(t->kilo, t->file);
+	}
+
+	int status = 0;
+	int ok = pid != -1 && waitpid(pid, &status, 0) == pid && WIFSTOPPED(status) &&
+		ptrace(PTRACE_SETOPTIONS, pid, NULL, (void *) (long) (PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE |
+			PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL)) == 0;
+	if (ok) fcntl(t->fd, F_SETFL, O_NONBLOCK);
+	else if (pid > 0) kill(pid, SIGKILL);
+
+	pthread_mutex_lock(&t->lock);
+	t->pid = ok ? pid : -1;
+	t->started = 1;
+	pthread_cond_signal(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+	if (!ok) return NULL;
+
+	ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+	pid_t tid;
+	while ((tid = waitpid(-1, &status, __WALL)) != -1) {
+		if (!WIFSTOPPED(status)) continue;
+		int sig = WSTOPSIG(status);
+		if (sig == (SIGTRAP | 0x80)) {
+			__atomic_add_fetch(&t->stops, 1, __ATOMIC_RELAXED);
+			sig = 0;
+		} else if ((status >> 16) != 0 || sig == SIGSTOP) {
+			/* clone and exec events, and the stop new threads start with. */
+			sig = 0;
+		}
+		ptrace(PTRACE_SYSCALL, tid, NULL, (void *) (long) sig);
+	}
+	return NULL;
+}
+
+/*** bench ***/
+
+int lat_cmp(const void *a, const void *b)
+{
+	long x = *(const long *) a, y = *(const long *) b;
+	return (x > y) - (x < y);
+}
+
+/* the p'th percentile of the n sorted values in v. */
+long percentile(long *v, size_t n, int p)
+{
+	if (n == 0) return 0;
+	size_t i = (n * p + 99) / 100;
+	return v[i ? i - 1 : 0];
+}
+
+/* kilo leaves its journal behind when it is killed, and would ask to recover it next time. */
+void journal_path(const char *file, char *path, size_t size)
+{
+	const char *slash = strrchr(file, '/');
+	size_t dirlen = slash ? (size_t) (slash - file + 1) : 0;
+	snprintf(path, size, "%.*s.%s.journal", (int) dirlen, file, file + dirlen);
+}
+
+/* bytes in the journal of file, -1 if there is none. */
+long journal_size(const char *file)
+{
+	char path[4096];
+	journal_path(file, path, sizeof(path));
+	struct stat st;
+	return stat(path, &st) == 0 ? (long) st.st_size : -1;
+}
+
+void remove_journal(const char *file)
+{
+	char path[4096];
+	journal_path(file, path, sizeof(path));
+	unlink(path);
+}
+
+/* run the keys of a script on a copy of file, once to time it and once traced to count system calls. */
+int bench_script(const char *kilo, const char *file, size_t lines, const char *name, keys *k, result *res)
+{
+	memset(res, 0, sizeof(*res));
+	res->script = name;
+	res->lines = lines;
+	res->nkeys = k->n - k->setup;
+	res->syscalls = -1;
+
+	char copy[4096];
+	snprintf(copy, sizeof(copy), "%s.%s", file, name);
+	char cmd[8192];
+	snprintf(cmd, sizeof(cmd), "cp '%s' '%s'", file, copy);
+	if (system(cmd) != 0) return -1;
+
+	run r;
+	memset(&r, 0, sizeof(r));
+	long start = now_us();
+	r.pid = kilo_spawn(kilo, copy, &r.fd);
+	if (r.pid == -1) return -1;
+	if (run_until(&r, 0) == -1) {
+		run_stop(&r, NULL);
+		return -1;
+	}
+	res->open_ms = (now_us() - start) / 1000.0;
+
+	size_t timed = k->n - k->setup;
+	long *lat = malloc(sizeof(long) * k->n);
+	r.bytes = calloc(k->n, sizeof(size_t));
+	r.k = k;
+	size_t i;
+	int err = 0;
+	for (i = 0; i < k->n && !err; i++) {
+		long t = now_us();
+		err = run_key(&r, k, i) == -1;
+		lat[i] = now_us() - t;
+	}
+	/* let frames drawn after the last key, by the highlighter say, come in. */
+	while (!err && run_read(&r, 50) == 1);
+	struct rusage ru;
+	run_stop(&r, &ru);
+	remove_journal(copy);
+
+	/* a script that saves has to have changed the file by as much as it typed. */
+	struct stat before, after;
+	if (!err && k->saves)
+		err = stat(file, &before) == -1 || stat(copy, &after) == -1 || (size_t) after.st_size != before.st_size + k->grows;
+
+	if (!err) {
+		long *t = &lat[k->setup];
+		qsort(t, timed, sizeof(long), lat_cmp);
+		res->p50 = percentile(t, timed, 50);
+		res->p90 = percentile(t, timed, 90);
+		res->p99 = percentile(t, timed, 99);
+		res->max = t[timed - 1];
+		size_t total = 0;
+		for (i = k->setup; i < k->n; i++) {
+			total += r.bytes[i];
+			if (r.bytes[i] > res->bytes_max) res->bytes_max = r.bytes[i];
+		}
+		res->bytes_mean = (double) total / timed;
+		res->rss_kb = ru.ru_maxrss;
+		res->anon_kb = r.anon_kb;
+	}
+	free(lat);
+	free(r.bytes);
+
+	/* the same again, traced, on a fresh copy. */
+	trace t;
+	memset(&t, 0, sizeof(t));
+	t.kilo = kilo;
+	t.file = copy;
+	pthread_mutex_init(&t.lock, NULL);
+	pthread_cond_init(&t.cond, NULL);
+	if (!err && system(cmd) == 0 && pthread_create(&t.thread, NULL, trace_thread, &t) == 0) {
+		pthread_mutex_lock(&t.lock);
+		while (!t.started) pthread_cond_wait(&t.cond, &t.lock);
+		pthread_mutex_unlock(&t.lock);
+		if (t.pid != -1) {
+			memset(&r, 0, sizeof(r));
+			r.pid = t.pid;
+			r.fd = t.fd;
+			int terr = run_until(&r, 0) == -1;
+			unsigned long stops = 0;
+			for (i = 0; i < k->n && !terr; i++) {
+				if (i == k->setup) stops = __atomic_load_n(&t.stops, __ATOMIC_RELAXED);
+				terr = run_key(&r, k, i) == -1;
+			}
+			stops = __atomic_load_n(&t.stops, __ATOMIC_RELAXED) - stops;
+			/* a call stops its thread going in and again coming out. */
+			if (!terr) res->syscalls = stops / 2.0 / timed;
+			run_stop(&r, NULL);
+		}
+		pthread_join(t.thread, NULL);
+		remove_journal(copy);
+	}
+	pthread_mutex_destroy(&t.lock);
+	pthread_cond_destroy(&t.cond);
+	unlink(copy);
+	return err ? -1 : 0;
+}
+
+/* run kilo -s on file and add what it prints to *tp. */
+int bench_scan(const char *kilo, const char *file, throughput **tp, size_t *ntp)
+{
+	char cmd[8192];
+	snprintf(cmd, sizeof(cmd), "'%s' -s '%s'", kilo, file);
+	FILE *fp = popen(cmd, "r");
+	if (fp == NULL) return -1;
+	throughput t;
+	while (fscanf(fp, "%15s %d %lf", t.what, &t.threads, &t.gbps) == 3) {
+		*tp = realloc(*tp, sizeof(throughput) * (*ntp + 1));
+		(*tp)[(*ntp)++] = t;
+	}
+	return pclose(fp) == 0 ? 0 : -1;
+}
+
+/* whether name is in the comma separated list only, everything is if it is NULL. */
+int script_wanted(const char *only, const char *name)
+{
+	if (only == NULL) return 1;
+	size_t len = strlen(name);
+	const char *p = only;
+	while ((p = strstr(p, name)) != NULL) {
+		if ((p == only || p[-1] == ',') && (p[len] == ',' || p[len] == '\0')) return 1;
+		p += len;
+	}
+	return 0;
+}
+
+/* say so and return 1 if a run allocated more than max_rss_mb megabytes on top of its longest line, or took
+ * longer than max_ms, either 0 if there is no limit.
+ */
+int over_budget(result *r, long max_rss_mb, long max_ms)
+{
+	int over = 0;
+	long max_kb = max_rss_mb * 1024 + (long) (r->width / 1024);
+	if (max_rss_mb && r->anon_kb > max_kb) {
+		fprintf(stderr, "%s took %ld MB of memory, more than %ld MB\n", r->script, r->anon_kb / 1024, max_kb / 1024);
+		over = 1;
+	}
+	if (max_ms && r->p99 > max_ms * 1000) {
+		fprintf(stderr, "%s took %.1f ms, more than %ld ms\n", r->script, r->p99 / 1000.0, max_ms);
+		over = 1;
+	}
+	return over;
+}
+
+void write_json(FILE *fp, const char *kilo, result *res, size_t n, throughput *tp, size_t ntp)
+{
+	fprintf(fp, "{\n  \"kilo\": \"%s\",\n  \"time\": %ld,\n  \"rows\": %d,\n  \"cols\": %d,\n  \"results\": [\n",
+		kilo, (long) time(NULL), BENCH_ROWS, BENCH_COLS);
+	size_t i;
+	for (i = 0; i < n; i++) {
+		result *r = &res[i];
+		fprintf(fp, "    {\"script\": \"%s\", \"lines\": %zu, \"width\": %zu, \"keys\": %zu, \"open_ms\": %.1f, "
+			"\"latency_us\": {\"p50\": %ld, \"p90\": %ld, \"p99\": %ld, \"max\": %ld}, "
+			"\"frame_bytes\": {\"mean\": %.1f, \"max\": %zu}, ",
+			r->script, r->lines, r->width, r->nkeys, r->open_ms, r->p50, r->p90, r->p99, r->max,
+			r->bytes_mean, r->bytes_max);
+		if (r->syscalls < 0) fprintf(fp, "\"syscalls_per_key\": null, ");
+		else fprintf(fp, "\"syscalls_per_key\": %.1f, ", r->syscalls);
+		fprintf(fp, "\"peak_rss_kb\": %ld, \"peak_anon_kb\": %ld}%s\n", r->rss_kb, r->anon_kb, i + 1 < n ? "," : "");
+	}
+	fprintf(fp, "  ],\n  \"throughput_gbps\": [\n");
+	for (i = 0; i < ntp; i++) {
+		fprintf(fp, "    {\"what\": \"%s\", \"threads\": %d, \"gbps\": %.2f}%s\n", tp[i].what, tp[i].threads,
+			tp[i].gbps, i + 1 < ntp ? "," : "");
+	}
+	fprintf(fp, "  ]\n}\n");
+}
+
+/*** checks ***/
+
+check checks[] = {
+	/* an empty query matches nowhere, but mustn't rule rows out for the query typed after it. */
+	{ "find-empty", "xx\nyy\nfoo\n", { "\x06", "q", "\x7f", "f", "\r", "Z", "\x13" }, "xx\nyy\nZfoo\n" },
+	{ "regex-empty", "xx\nyy\nfoo\n", { "\x07", "q", "\x7f", "f", "\r", "Z", "\x13" }, "xx\nyy\nZfoo\n" },
+	/* the longest match from the leftmost start, found again after moving on to the next match. */
+	{ "regex-next", "ab xxab yab\n", { "\x07", "x*ab", "\x1b[C", "\x1b[C", "\r", "Z", "\x13" }, "ab xxab yZab\n" },
+	/* a replace-all is undone by a single CTRL-Z. */
+	{ "replace", "a foo b foo\nfoo\nnone\n", { "\x12", "foo", "\r", "barbaz", "\r", "\x13" },
+		"a barbaz b barbaz\nbarbaz\nnone\n" },
+	{ "replace-undo", "a foo b foo\nfoo\nnone\n", { "\x12", "foo", "\r", "barbaz", "\r", "\x1a", "\x1b[H", "X", "\x13" },
+		"Xa foo b foo\nfoo\nnone\n" },
+	/* a replace that deletes right before a backspace is its own step, and undoing it leaves the backspace. */
+	{ "replace-step", "xay\n", { "\x1b[C\x1b[C", "\x7f", "\x12", "x", "\r", "z", "\r", "\x1a", "\x13" }, "xy\n" },
+	/* a typed word is undone in one go. */
+	{ "type-undo", "x\n", { "ab", "c", "\x1a", "\x13" }, "x\n" },
+};
+
+/* write text to path, return -1 if it couldn't be. */
+int write_file(const char *path, const char *text)
+{
+	FILE *fp = fopen(path, "w");
+	if (fp == NULL) return -1;
+	fputs(text, fp);
+	return fclose(fp);
+}
+
+/* wait for file to say want, reading what kilo draws meanwhile if it runs on r. Return 0 once it does. */
+int wait_file(run *r, const char *file, const char *want)
+{
+	size_t wantlen = strlen(want);
+	char got[256];
+	long start = now_us();
+	while (now_us() - start < BENCH_TIMEOUT * 1000L) {
+		int fd = open(file, O_RDONLY);
+		ssize_t n = fd == -1 ? -1 : read(fd, got, sizeof(got));
+		if (fd != -1) close(fd);
+		if (n == (ssize_t) wantlen && memcmp(got, want, wantlen) == 0) return 0;
+		if (r == NULL) return -1;
+		if (run_read(r, 10) == -1) return -1;
+	}
+	return -1;
+}
+
+/* type the keys of c into kilo on a file in dir, return 0 if it saved what it should have. */
+int run_check(const char *kilo, const char *dir, check *c)
+{
+	char file[4096];
+	snprintf(file, sizeof(file), "%s/%s.c", dir, c->name);
+	if (write_file(file, c->text) == -1) return -1;
+
+	run r;
+	memset(&r, 0, sizeof(r));
+	r.pid = kilo_spawn(kilo, file, &r.fd);
+	if (r.pid == -1) return -1;
+	int err = run_until(&r, 0) == -1;
+	size_t i, sent = 0;
+	for (i = 0; c->keys[i] && !err; i++) {
+		size_t len = strlen(c->keys[i]);
+		sent += len;
+		err = run_send(&r, c->keys[i], len) == -1 || run_until(&r, sent) == -1;
+		/* give whatever the key started on another thread time to finish. */
+		while (!err && run_read(&r, 50) == 1);
+	}
+
+	/* the save happens in the background, wait for it to show up. */
+	if (!err) err = wait_file(&r, file, c->want) == -1;
+	run_stop(&r, NULL);
+	remove_journal(file);
+	unlink(file);
+	return err ? -1 : 0;
+}
+
+/* kilo -b runs a script on two files at once, and won't take a JOBS that isn't a number. */
+int check_batch(const char *kilo, const char *dir)
+{
+	char script[4096], a[4096], b[4096], cmd[16384];
+	snprintf(script, sizeof(script), "%s/batch.txt", dir);
+	snprintf(a, sizeof(a), "%s/batch-a.c", dir);
+	snprintf(b, sizeof(b), "%s/batch-b.c", dir);
+	int err = write_file(script, "# comments and blank lines are skipped\n\nreplace foo bar\ngoto 2 1\ninsert X\n") == -1 ||
+		write_file(a, "foo 1\nfoo 2\n") == -1 || write_file(b, "a\nb foo\n") == -1;
+
+	snprintf(cmd, sizeof(cmd), "'%s' -b '%s' -j foo '%s' 2>/dev/null", kilo, script, a);
+	int st = err ? -1 : system(cmd);
+	err = err || !WIFEXITED(st) || WEXITSTATUS(st) != 2 || wait_file(NULL, a, "foo 1\nfoo 2\n") == -1;
+	snprintf(cmd, sizeof(cmd), "'%s' -b '%s' -j 2 2>/dev/null", kilo, script);
+	st = err ? -1 : system(cmd);
+	err = err || !WIFEXITED(st) || WEXITSTATUS(st) != 2;
+
+	snprintf(cmd, sizeof(cmd), "'%s' -b '%s' -j 2 '%s' '%s'", kilo, script, a, b);
+	st = err ? -1 : system(cmd);
+	err = err || !WIFEXITED(st) || WEXITSTATUS(st) != 0 ||
+		wait_file(NULL, a, "bar 1\nXbar 2\n") == -1 || wait_file(NULL, b, "a\nXb bar\n") == -1;
+	unlink(script);
+	unlink(a);
+	unlink(b);
+	return err ? -1 : 0;
+}
+
+/* kilo killed before it saved replays what was typed once it is started on the file again, and a save leaves
+ * behind a journal with no edits in it, which isn't offered for replay after the next kill.
+ */
+int check_journal(const char *kilo, const char *dir)
+{
+	char file[4096];
+	snprintf(file, sizeof(file), "%s/journal.c", dir);
+	if (write_file(file, "abc\n") == -1) return -1;
+
+	run r;
+	memset(&r, 0, sizeof(r));
+	struct rusage ru;
+	r.pid = kilo_spawn(kilo, file, &r.fd);
+	if (r.pid == -1) return -1;
+	int err = run_until(&r, 0) == -1;
+	/* a fresh journal only says which version of the file it is for. */
+	long head = journal_size(file);
+	err = err || head <= 0 || run_send(&r, "XY", 2) == -1 || run_until(&r, 2) == -1;
+	/* the journal thread writes edits out a little while after they are made. */
+	long start = now_us();
+	while (!err && journal_size(file) <= head) {
+		err = run_read(&r, 10) == -1 || now_us() - start > BENCH_TIMEOUT * 1000L;
+	}
+	run_stop(&r, &ru);
+	err = err || wait_file(NULL, file, "abc\n") == -1;
+
+	/* say yes to replaying the edits, and save them. */
+	memset(&r, 0, sizeof(r));
+	r.pid = err ? -1 : kilo_spawn(kilo, file, &r.fd);
+	if (r.pid != -1) {
+		err = run_until(&r, 0) == -1 || run_send(&r, "y\r", 2) == -1 || run_until(&r, 2) == -1 ||
+			run_send(&r, "\x13", 1) == -1 || run_until(&r, 3) == -1 || wait_file(&r, file, "XYabc\n") == -1;
+		/* once the save is done its journal takes over, holding nothing yet. */
+		start = now_us();
+		while (!err && journal_size(file) != head) {
+			err = run_read(&r, 10) == -1 || now_us() - start > BENCH_TIMEOUT * 1000L;
+		}
+		run_stop(&r, &ru);
+	} else {
+		err = 1;
+	}
+
+	/* nothing is offered after the next kill, the first key goes into the file. */
+	memset(&r, 0, sizeof(r));
+	r.pid = err ? -1 : kilo_spawn(kilo, file, &r.fd);
+	if (r.pid != -1) {
+		err = run_until(&r, 0) == -1 || run_send(&r, "Z\x13", 2) == -1 || run_until(&r, 2) == -1 ||
+			wait_file(&r, file, "ZXYabc\n") == -1;
+		run_stop(&r, &ru);
+	} else {
+		err = 1;
+	}
+	remove_journal(file);
+	unlink(file);
+	return err ? -1 : 0;
+}
+
+/*** init ***/
+
+int main(int argc, char *argv[])
+{
+	const char *kilo = "./kilo_bench";
+	const char *out = "bench.json";
+	char *sizes = "1000,100000,1000000,10000000";
+	char *widths = "10000,100000,1000000,10000000";
+	size_t scan_mb = 256;
+	const char *only = NULL;
+	long max_rss_mb = 0, max_ms = 0;
+	int check_only = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "k:o:l:w:g:r:m:t:c")) != -1) {
+		switch (opt) {
+			case 'k': kilo = optarg; break;
+			case 'o': out = optarg; break;
+			case 'l': sizes = optarg; break;
+			case 'w': widths = optarg; break;
+			case 'g': scan_mb = strtoul(optarg, NULL, 10); break;
+			case 'r': only = optarg; break;
+			case 'm': max_rss_mb = strtol(optarg, NULL, 10); break;
+			case 't': max_ms = strtol(optarg, NULL, 10); break;
+			case 'c': check_only = 1; break;
+			default:
+				fprintf(stderr, "Usage: bench [-k KILO] [-o OUT.json] [-l LINES,...] [-w WIDTHS,...] [-g SCAN_MB] "
+					"[-r SCRIPTS,...] [-m MAX_RSS_MB] [-t MAX_MS] [-c]\n");
+				return 2;
+		}
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	char dir[] = "/tmp/kilo-bench.XXXXXX";
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+
+	if (check_only) {
+		int failed = 0;
+		size_t i;
+		for (i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+			int ok = run_check(kilo, dir, &checks[i]) == 0;
+			fprintf(stderr, "%-16s %s\n", checks[i].name, ok ? "ok" : "FAILED");
+			failed += !ok;
+		}
+		struct {
+			const char *name;
+			int (*run)(const char *, const char *);
+		} more[] = {
+			{ "batch", check_batch },
+			{ "journal", check_journal },
+		};
+		for (i = 0; i < sizeof(more) / sizeof(more[0]); i++) {
+			int ok = more[i].run(kilo, dir) == 0;
+			fprintf(stderr, "%-16s %s\n", more[i].name, ok ? "ok" : "FAILED");
+			failed += !ok;
+		}
+		rmdir(dir);
+		return failed ? 1 : 0;
+	}
+
+	struct {
+		const char *name;
+		void (*make)(keys *, size_t);
+	} scripts[] = {
+		{ "type", script_type },
+		{ "page", script_page },
+		{ "search", script_search },
+		{ "paste", script_paste },
+		{ "eof", script_eof },
+	}, long_scripts[] = {
+		{ "long", script_long },
+		{ "eof", script_eof_long },
+	};
+	size_t nscripts = sizeof(scripts) / sizeof(scripts[0]);
+	size_t nlong = sizeof(long_scripts) / sizeof(long_scripts[0]);
+
+	result *res = NULL;
+	size_t nres = 0;
+	int status = 0;
+	char *list = strdup(sizes), *save = NULL, *tok;
+	fprintf(stderr, "%10s %-8s %9s %9s %9s %9s %10s %9s %10s %10s\n", "lines", "script", "open ms", "p50 us",
+		"p99 us", "max us", "bytes/key", "sys/key", "rss kb", "anon kb");
+	for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		size_t lines = strtoul(tok, NULL, 10);
+		char file[4096];
+		snprintf(file, sizeof(file), "%s/bench%zu.c", dir, lines);
+		if (gen_file(file, lines) == -1) {
+			perror(file);
+			status = 1;
+			break;
+		}
+		size_t i;
+		for (i = 0; i < nscripts; i++) {
+			if (!script_wanted(only, scripts[i].name)) continue;
+			keys k;
+			memset(&k, 0, sizeof(k));
+			scripts[i].make(&k, lines);
+			res = realloc(res, sizeof(result) * (nres + 1));
+			if (bench_script(kilo, file, lines, scripts[i].name, &k, &res[nres]) == -1) {
+				fprintf(stderr, "%10zu %-8s kilo stopped answering\n", lines, scripts[i].name);
+				status = 1;
+			} else {
+				result *r = &res[nres++];
+				fprintf(stderr, "%10zu %-8s %9.1f %9ld %9ld %9ld %10.0f %9.1f %10ld %10ld\n", r->lines, r->script,
+					r->open_ms, r->p50, r->p99, r->max, r->bytes_mean, r->syscalls, r->rss_kb, r->anon_kb);
+				if (over_budget(r, max_rss_mb, max_ms)) status = 1;
+			}
+			keys_free(&k);
+		}
+		unlink(file);
+	}
+	free(list);
+
+	list = strdup(widths);
+	for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		size_t width = strtoul(tok, NULL, 10);
+		char file[4096];
+		snprintf(file, sizeof(file), "%s/long%zu.c", dir, width);
+		if (gen_line(file, width) == -1) {
+			perror(file);
+			status = 1;
+			break;
+		}
+		size_t i;
+		for (i = 0; i < nlong; i++) {
+			if (!script_wanted(only, long_scripts[i].name)) continue;
+			keys k;
+			memset(&k, 0, sizeof(k));
+			long_scripts[i].make(&k, width);
+			res = realloc(res, sizeof(result) * (nres + 1));
+			if (bench_script(kilo, file, 1, long_scripts[i].name, &k, &res[nres]) == -1) {
+				fprintf(stderr, "%9zuc %-8s kilo stopped answering\n", width, long_scripts[i].name);
+				status = 1;
+			} else {
+				result *r = &res[nres++];
+				r->width = width;
+				fprintf(stderr, "%9zuc %-8s %9.1f %9ld %9ld %9ld %10.0f %9.1f %10ld %10ld\n", r->width, r->script,
+					r->open_ms, r->p50, r->p99, r->max, r->bytes_mean, r->syscalls, r->rss_kb, r->anon_kb);
+				if (over_budget(r, max_rss_mb, max_ms)) status = 1;
+			}
+			keys_free(&k);
+		}
+		unlink(file);
+	}
+	free(list);
+
+	throughput *tp = NULL;
+	size_t ntp = 0;
+	if (scan_mb > 0) {
+		char file[4096];
+		snprintf(file, sizeof(file), "%s/scan%zu.c", dir, scan_mb);
+		if (gen_file(file, (scan_mb << 20) / BENCH_LINE_BYTES) == -1) {
+			perror(file);
+			status = 1;
+		} else if (bench_scan(kilo, file, &tp, &ntp) == -1) {
+			fprintf(stderr, "%8zuMB kilo -s failed\n", scan_mb);
+			status = 1;
+		}
+		size_t i;
+		for (i = 0; i < ntp; i++)
+			fprintf(stderr, "%8zuMB %-8s %6d threads %8.2f GB/s\n", scan_mb, tp[i].what, tp[i].threads, tp[i].gbps);
+		unlink(file);
+	}
+	rmdir(dir);
+
+	FILE *fp = strcmp(out, "-") == 0 ? stdout : fopen(out, "w");
+	if (fp == NULL) {
+		perror(out);
+		return 1;
+	}
+	write_json(fp, kilo, res, nres, tp, ntp);
+	if (fp != stdout) fclose(fp);
+	free(res);
+	free(tp);
+	return status;
+}
@@ -16,17 +16,74 @@
 #include <time.h>
 #include <stdarg.h>	/* For implementing variadic functions - functions with variable number of arguments. */
 #include <fcntl.h>	/* for file control. */
+#include <sys/mman.h>	/* for mapping files into memory. */
+#include <sys/stat.h>
+#include <sys/uio.h>	/* for writing many rows with one call. */
+#include <sys/wait.h>
+#include <pthread.h>
+#include <poll.h>		/* for waiting on input and events at the same time. */
+#include <signal.h>
+#include <sched.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>	/* SSE2 and AVX2 intrinsics for the newline scanner. */
+#define KILO_X86 1
+#endif
 
 /*** defines ***/
 
 #define KILO_VERSION "0.0.1"
 
-#define KILO_TAB_STOP 8
+#define KILO_TAB_STOP 8	/* tab stop until it is changed with CTRL-E. */
+#define KILO_TAB_STOP_MAX 32	/* biggest tab stop CTRL-E takes. */
+#define KILO_TAB_BLOCK 1024	/* chars in a block of a tab map. */
+#define KILO_LONG_ROW 8192	/* rows at least this long get a tab map, and only have the columns near the screen rendered. */
+#define KILO_WINDOW_MARGIN 256	/* columns rendered past either side of the screen on long rows. */
+#define KILO_LEX_BLOCK 1024	/* chars of a long row between the marks its lexing can be picked up again from. */
+#define KILO_LEX_REACH 64	/* furthest the lexer looks ahead of the token it is in. */
+#define KILO_HL_RESYNC 64	/* rows above the screen lexed to guess the state it starts in, when those above aren't lexed yet. */
+#define ATTR_INVERSE 0x80	/* screen cell attribute for swapped foreground and background. */
 #define KILO_QUIT_TIMES 3
+#define KILO_INPUT_SIZE 4096	/* bytes of pending input read from the terminal at once. */
+#define KILO_ESC_TIMEOUT 100	/* milliseconds to wait for the rest of an escape sequence. */
+#define KILO_SCAN_BATCH (1 << 20)	/* bytes a worker thread looks at before it lets go of the editor lock. */
+#define KILO_PROGRESS_MS 50	/* how often a worker thread asks for the screen to be redrawn. */
+#define KILO_FIND_WINDOW (1 << 16)	/* bytes of rows a search key looks through itself, the rest is left to the worker. */
+#define KILO_CACHE_BUDGET (8 << 20)	/* bytes of render and hl kept around for rows that are not being edited. */
+#define KILO_INDEX_THREADS 8		/* most threads used to index the lines of a file. */
+#define KILO_SAVE_IOV 1024	/* pieces of the file handed to writev() at once. */
+#define KILO_INDEX_CHUNK (16 << 20)	/* files are only indexed in parallel if every thread gets at least this many bytes. */
+#define KILO_REGEX_STATES 20000	/* most NFA states a regex may compile to. */
+#define KILO_REGEX_REPEAT 1000	/* largest count allowed in a {n,m} bound. */
+#define KILO_DFA_STATES 1024	/* DFA states kept before they are all thrown away and built again. */
+#define KILO_REGEX_WINDOW (1 << 16)	/* bytes of a row the starts of regex matches are marked in at a time. */
+#define KILO_UNDO_LIMIT (64 << 20)	/* bytes of undo history kept, the oldest is dropped first. */
+#define KILO_JOURNAL_MS 200	/* most milliseconds an edit waits before it is written to the journal. */
+#define KILO_JOURNAL_OPS 1024	/* edits that are written to the journal right away, without waiting that long. */
+#define KILO_JOURNAL_MAGIC "KILOJNL1"
+#define KILO_PROF_FRAMES 32	/* frames the readout in the status bar is worked out over. */
+#define KILO_PROF_SPANS (1 << 18)	/* spans kept for the trace, the oldest are dropped first. */
+
+#define HL_HIGHLIGHT_NUMBERS (1 << 0)
+#define HL_HIGHLIGHT_STRINGS (1 << 1)
+
+#ifdef KILO_DEBUG
+/* debug builds count heap allocations, to check that a frame with nothing new to render makes none. */
+size_t alloc_count;
+void *debug_malloc(size_t);
+void *debug_realloc(void *, size_t);
+#define malloc(n) debug_malloc(n)
+#define realloc(p, n) debug_realloc(p, n)
+#endif
+
+/* row number that stands for no row at all. */
+#define NO_ROW ((size_t) -1)
 
 /* convert key 'char' to CTRL-char */
 #define CTRL_KEY(k) ((k) & 0x1f) /* bitwise AND with 00011111, setting last 3 bits to 0. */
 
+#define TEXT_AT(t, i) (((i) < (t)->gap) ? (t)->s[i] : (t)->s[(i) + (t)->gaplen])	/* character i of a lex_text. */
+
 /*** data ***/
 
 enum editor_key {
@@ -39,100 +96,816 @@ enum editor_key {
 	HOME_KEY,
 	END_KEY,
 	PAGE_UP,
-	PAGE_DOWN
+	PAGE_DOWN,
+	PASTE_START,	/* the terminal is about to send pasted text, see read_paste(). */
+	PROMPT_IDLE	/* not a key, a prompt was woken up by a worker and lets its callback look again. */
 };
 
 enum editor_highlight {
 	HL_NORMAL = 0,
+	HL_COMMENT,
+	HL_MLCOMMENT,
+	HL_KEYWORD1,
+	HL_KEYWORD2,
+	HL_STRING,
 	HL_NUMBER,
 	HL_MATCH
 };
 
+/* what the lexer is in the middle of at the end of a row, and so at the start of the next one. */
+enum lex_state {
+	LEX_NORMAL = 0,
+	LEX_COMMENT,	/* a multi-line comment. */
+	LEX_DQUOTE,	/* a double quoted string continued with a backslash. */
+	LEX_SQUOTE,	/* a single quoted string continued with a backslash. */
+	LEX_LINE_COMMENT,	/* a single line comment, only ever in the middle of a row. */
+	LEX_UNKNOWN = 255	/* not lexed yet, never the result of lexing a row so it never matches one. */
+};
+
+/* how to highlight a language, and the files it is used for. */
+struct editor_syntax {
+	char *filetype;
+	char **filematch;	/* extensions starting with '.', or patterns found anywhere in the filename. */
+	char **keywords;	/* keywords ending in '|' are highlighted as types. */
+	char *singleline_comment_start;
+	char *multiline_comment_start;
+	char *multiline_comment_end;
+	int flags;
+};
+
+/* the hot paths the profiler times. */
+enum prof_kind {
+	PROF_READ_KEY = 0,
+	PROF_KEYPRESS,
+	PROF_ROW_RENDER,
+	PROF_UPDATE_SYNTAX,
+	PROF_DRAW_ROWS,
+	PROF_WRITE,
+	PROF_FRAME,	/* all of refresh_screen(). */
+	PROF_KINDS
+};
+
+const char *prof_names[PROF_KINDS] = {
+	"read_key", "process_keypress", "row_render", "update_syntax", "draw_rows", "write", "frame"
+};
+
+enum regex_type {
+	RE_EMPTY,
+	RE_CLASS,
+	RE_BEGIN,
+	RE_END,
+	RE_CAT,
+	RE_ALT,
+	RE_REPEAT
+};
+
+/* labels of NFA edges that don't consume a byte. */
+enum regex_edge {
+	RE_EDGE_EMPTY = -1,
+	RE_EDGE_BEGIN = -2,	/* only taken at the beginning of the text. */
+	RE_EDGE_END = -3	/* only taken at the end of the text. */
+};
+
+/* How a run of chars moves the render column. Up to its first tab a run adds a column per char, after it the
+ * columns only depend on the tab stop the tab ends at. So a run starting at column x ends at
+ *     x + pre                      if it has no tab, or
+ *     tab_next(x + pre) + post     if it has, tab_next() being the column the tab ends at.
+ */
+typedef struct tab_span {
+	size_t len;	/* chars in the run. */
+	size_t pre;	/* columns before the first tab. */
+	size_t post;	/* columns after the first tab, starting from a tab stop. */
+	int tab;
+} tab_span;
+
+/* how far the lexer got into a row, which is enough to carry on from there. */
+typedef struct lex_pos {
+	unsigned char state;	/* a lex_state. */
+	unsigned char prev_sep;	/* the character before separates words. */
+	unsigned char number;	/* the character before is part of a number. */
+	unsigned char escaped;	/* the row ends in a backslash inside a string. */
+} lex_pos;
+
+/* text with a gap in it the way the chars of a row have, so the lexer and the search can read a row
+ * without moving its gap out of the way.
+ */
+typedef struct lex_text {
+	const char *s;
+	size_t len;
+	size_t gap;	/* the characters from gap on are gaplen further along in s. */
+	size_t gaplen;
+} lex_text;
+
+/* a place in a long row its lexing can be picked up again from. */
+typedef struct lex_mark {
+	size_t at;
+	lex_pos pos;
+} lex_mark;
+
+/* A row's chars cut into blocks of about KILO_TAB_BLOCK, in a segment tree of tab_spans. Going down it finds
+ * the render column of any char, or the char at any render column, in O(log n) plus the walk of a block.
+ */
+typedef struct tab_map {
+	int tabstop;	/* the tab stop it was built for. */
+	size_t leaves;	/* a power of two, the leaves past the last block are empty. */
+	tab_span *tree;	/* node 1 is the root, node n has children 2n and 2n + 1, the leaves start at leaves. */
+} tab_map;
+
 typedef struct erow {
-	int size;
-	int rsize;
-	char *chars;		/* the literal characters in the row. */
+	size_t size;
+	size_t rsize;
+	char *chars;		/* the literal characters in the row, with a gap at gap. */
+	size_t gap;	/* the gaplen bytes at gap are free, so edits in one place don't move the rest of the row. */
+	size_t gaplen;	/* the chars at and after gap are at chars[gap + gaplen] on, row_text() closes it up. */
 	char *render;		/* the characters to render in this row - for dealing with tabs and nonprintable characters. */
 	unsigned char *hl;	/* store the highlighting information of this row. */
+	size_t rx0;	/* the render column render and hl start at, long rows only have the columns near the screen. */
+	unsigned char hl_in;	/* the lex_state at the start of the row hl was worked out from. */
+	unsigned char hl_out;	/* the lex_state at its end. */
+	tab_map *tabs;	/* for converting between cx and rx on long rows, NULL until it is needed. */
+	lex_mark *marks;	/* on long rows, where the lexer was every KILO_LEX_BLOCK chars or so, kept with render. */
+	size_t nmarks;
+	/* render and hl are a cache filled by row_render() when the row is drawn.
+	 * Rows with a filled cache are kept in a list, most recently drawn first.
+	 */
+	struct erow *cache_prev;
+	struct erow *cache_next;
 } erow;
 
+/* The rows of the file are kept in an implicit treap, a rope whose leaves are lines.
+ * Each node holds one row and the number of rows in its subtree, so a row can be
+ * looked up, inserted or removed by its position in O(log n) without moving the
+ * rest of the file around in memory.
+ * A node can also stand for a span of lines of the mapped file that have not been
+ * loaded yet. Such a span is cut up when one of its lines is first needed as an erow.
+ */
+typedef struct rnode {
+	erow row;
+	size_t span;		/* number of unloaded file lines held by this node, 0 if it holds a loaded row. */
+	size_t line;		/* index of the first line of the span in E.lines. */
+	size_t count;		/* number of rows in this subtree. */
+	unsigned int prio;	/* random priority, parents always have a higher one than their children. */
+	struct rnode *left;
+	struct rnode *right;
+} rnode;
+
+/* a node of the syntax tree of a regex. */
+typedef struct regex_node {
+	int type;
+	int a, b;	/* children, or the class of a RE_CLASS node in a. */
+	int min, max;	/* bounds of a RE_REPEAT node, max is -1 if there is none. */
+} regex_node;
+
+/* An NFA whose edges either consume one byte of a class or consume nothing. */
+typedef struct nfa {
+	int nstates;
+	int start;
+	int accept;
+	int *off;	/* the edges leaving state s are off[s] to off[s + 1] - 1. */
+	int *to;
+	int *label;	/* index of a class, or one of the RE_EDGE values. */
+	unsigned char (*classes)[32];	/* one bit for each byte of each class. */
+} nfa;
+
+/* a state of a DFA, the set of NFA states it stands for. */
+typedef struct dstate {
+	int *set;	/* sorted. */
+	int n;
+	int accept;	/* the NFA accepting state is in set. */
+	int accept_end;	/* the accepting state can be reached if this is the end of the text. */
+	int next[256];	/* the state after each byte, -1 if it has not been needed yet. */
+} dstate;
+
+/* A DFA built lazily from an NFA, a state at a time as the text being searched needs it. */
+typedef struct dfa {
+	nfa *nfa;
+	int unanchored;	/* a match may start anywhere in the text, not just at its beginning. */
+	dstate *states;
+	int n;
+	unsigned int flushes;	/* times all states were thrown away, which invalidates state numbers. */
+	int *table;	/* hash table of the states by their set. */
+	int start[2];	/* start state in the middle and at the beginning of the text, -1 if not built yet. */
+	int *stack;	/* scratch space to build new states in. */
+	int *set;
+	unsigned int *mark;	/* NFA states already in the set being built are marked with gen. */
+	unsigned int gen;
+} dfa;
+
+typedef struct regex {
+	regex_node *nodes;
+	int nnodes;
+	int cap;
+	unsigned char (*classes)[32];
+	int nclasses;
+	int ccap;
+	int *edges;	/* from, to and label of each NFA edge. */
+	int nedges;
+	int ecap;
+	int nstates;
+	const char *error;
+	nfa fwd;
+	nfa rev;	/* fwd with all its edges reversed. */
+	dfa match;	/* runs fwd from the start of a match to find its end. */
+	dfa starts;	/* runs rev backwards through a text to find where matches start. */
+	char *literal;	/* text every match contains, so texts without it needn't be scanned. */
+	int literal_len;
+} regex;
+
+/* Where a search of one row is up to, so that the search of a long row can be put down and picked up
+ * again. A regex is first run backwards over the whole row, keeping the state of its DFA at the end of
+ * every KILO_REGEX_WINDOW bytes. The starts of its matches are then marked one window at a time going
+ * forward, from the state kept for the end of that window.
+ */
+typedef struct search_scan {
+	size_t len;	/* length of the row. */
+	size_t from;	/* the next match is looked for from here, len once there are no more. */
+	size_t back;	/* the regex has been run backwards from the end of the row down to here. */
+	int *sets;	/* the NFA states of the DFA state kept for each window, the last window's first. */
+	size_t nsets;
+	size_t setcap;
+	size_t *set_off;	/* the states of the k-th window kept start at set_off[k] in sets. */
+	size_t nkept;	/* windows whose state has been kept. */
+	size_t keptcap;
+	unsigned char *starts_at;	/* 1 for each offset of the marked window a match starts at. */
+	size_t base;	/* offset of the marked window in the row, NO_ROW if none is. */
+} search_scan;
+
+/* what the search prompt is looking for. */
+typedef struct search_query {
+	char *text;	/* NULL while there is no search going on. */
+	size_t len;
+	int regex;	/* text is a regex rather than literal text. */
+	regex *re;	/* text compiled, NULL if it isn't a valid regex. */
+	const char *error;	/* why text isn't a valid regex. */
+	/* One bit per row, set once the row is known not to contain skip_query.
+	 * A query that contains skip_query can't be in those rows either, so as the
+	 * query is typed only the rows that are left get searched again.
+	 */
+	unsigned char *skip;
+	char *skip_query;
+	search_scan scan;	/* the row the main thread is searching. */
+} search_query;
+
+/* the position of a search match. */
+typedef struct match {
+	size_t row;
+	size_t col;	/* offset of the match in the characters of the row. */
+	size_t len;
+} match;
+
+/* All the matches of the current search, found by a worker thread in the background. */
+typedef struct match_table {
+	pthread_t thread;
+	int active;	/* the thread was started and has to be joined. */
+	int cancel;	/* tells the thread to stop. */
+	int done;	/* the thread has scanned the whole file. */
+	match *m;	/* sorted by position, as the file is scanned from the top. */
+	size_t n;
+	size_t cap;
+	size_t scanned;	/* rows scanned so far. */
+	search_scan scan;	/* how far the thread has got through the row it is on. */
+	int partway;	/* scan is part of the way through row scanned. */
+	/* When the query is a longer version of the last one only the rows it can still be in are scanned: the rows
+	 * in keep, which are below rest, and every row from rest on. rest is 0 when every row is scanned.
+	 */
+	size_t *keep;
+	size_t nkeep;
+	size_t next_keep;	/* the first row in keep not scanned yet. */
+	size_t rest;
+	size_t cur_row;	/* the match the cursor was put on, cur_row is NO_ROW if there is none. */
+	size_t cur_col;
+	size_t cur_len;	/* drawn as HL_MATCH while the search prompt is up, 0 when it isn't. */
+} match_table;
+
+/* A replace-all running on a worker thread, one pass from the top of the file. */
+typedef struct replace_job {
+	pthread_t thread;
+	int active;	/* the thread was started and has to be joined. */
+	char *find;
+	size_t flen;
+	char *with;
+	size_t wlen;
+	size_t row;	/* next row to look at, rows above it are done. */
+	size_t count;	/* replacements made so far. */
+	size_t *hits;	/* offsets of the matches in the row being rebuilt. */
+	size_t cap;
+	unsigned long step;	/* undo step all the replacements are logged with. */
+	struct timespec start;
+} replace_job;
+
+enum undo_type {
+	UNDO_INSERT,
+	UNDO_DELETE
+};
+
+/* An edit in the undo log, text inserted into or deleted from the rows as if they were one
+ * string with a '\n' between every two rows. It is followed in the log by the text itself.
+ */
+typedef struct undo_op {
+	int type;
+	unsigned long step;	/* ops with the same step were made by one command and are undone together. */
+	size_t row, col;	/* where the text starts. */
+	size_t end_row, end_col;	/* where it ends. */
+	size_t len;
+} undo_op;
+
+/* The undo history, kept in a single arena. Every op is followed by its text and then by
+ * its total size, so the log can be walked back from the end as well as forward.
+ */
+typedef struct undo_log {
+	char *buf;
+	size_t cap;
+	size_t start;	/* the oldest op still kept. */
+	size_t end;	/* ops from start to end can be undone. */
+	size_t top;	/* ops from end to top were undone and can be redone. */
+	size_t limit;	/* most bytes of history kept. */
+	unsigned long step;	/* step of the command being run. */
+	int truncated;	/* set once a step was too big to keep, nothing from before it can be undone. */
+	unsigned long lost_step;	/* the step that was too big, the rest of its ops aren't logged either. */
+	int replaying;	/* set while undoing or redoing, so the edits made aren't logged again. */
+} undo_log;
+
+/* the start of a journal file, which says what file its edits are to be made to. */
+typedef struct journal_head {
+	char magic[8];
+	off_t size;
+	struct timespec mtime;
+} journal_head;
+
+/* The journal, a file next to the one being edited that every edit is appended to, so
+ * they can be made again if the editor dies before they are saved. Edits are collected in
+ * buf and a thread of its own writes and syncs them a batch at a time.
+ * A save starts a new journal for the file it writes. The edits made after the snapshot
+ * go to both, and the new journal takes over once the save is done.
+ */
+typedef struct journal {
+	pthread_t thread;
+	pthread_cond_t cond;	/* signalled when there are edits to write. */
+	int fd;	/* -1 if there is no journal. */
+	char *path;
+	int next_fd;	/* the journal started by a running save, -1 if there is none. */
+	char *next_path;
+	int rotate;	/* 1 once the save is done and next has to take over, -1 if the save failed. */
+	char *buf;	/* edits that haven't been written yet, undo_ops each followed by its text. */
+	size_t len;
+	size_t cap;
+	size_t split;	/* bytes of buf from before the snapshot, which don't go to next. */
+	int ops;
+	int replaying;	/* set while the journal is being replayed, so the edits aren't logged again. */
+} journal;
+
+/* how a save running in the background is getting on, in memory shared with the process doing it. */
+typedef struct save_state {
+	volatile size_t rows;	/* rows written so far. */
+	volatile ssize_t bytes;	/* size of the file written, -1 if the save failed. */
+	volatile int err;	/* errno of the failure. */
+	volatile int done;	/* set just before the child wakes us up and exits. */
+} save_state;
+
+/* A save made by a child process. The child gets a copy-on-write snapshot of the whole
+ * editor from fork(), so it can write the rows as they were while editing goes on.
+ */
+typedef struct save_job {
+	pid_t pid;	/* 0 if no save is running. */
+	int dirty;	/* E.dirty when the snapshot was taken. */
+	size_t numrows;
+	int shown;	/* percentage last shown in the status bar. */
+	save_state *state;
+} save_job;
+
+/* A frame of the terminal screen, screenrows + 2 rows of screencols cells.
+ * Characters and attributes are kept apart, so a run of cells goes out with a single copy.
+ */
+typedef struct frame {
+	char *chars;
+	unsigned char *attrs;	/* SGR foreground color of each cell (0 for the default one), or'ed with ATTR_INVERSE. */
+} frame;
+
+/* a stretch of time spent on one of the hot paths. */
+typedef struct prof_span {
+	long long start;	/* nanoseconds since the profiler was turned on. */
+	long long dur;
+	size_t bytes;	/* bytes written, for frames. */
+	unsigned char kind;
+	unsigned char worker;	/* spent by a worker thread rather than the main one. */
+} prof_span;
+
+/* Times the hot paths with a monotonic clock while the readout is shown or a trace is wanted.
+ * Spans are only recorded with the editor lock held, like everything else that touches E.
+ */
+typedef struct profiler {
+	int on;
+	int hud;	/* show frame times and sizes in the status bar, toggled with CTRL-T. */
+	char *trace;	/* file the spans are written to on exit, NULL for none. */
+	pthread_t main;
+	long long epoch;
+	prof_span *spans;	/* ring of the last KILO_PROF_SPANS spans, allocated only for a trace. */
+	size_t nspans;	/* spans recorded so far, the ring holds the last of them. */
+	long long frame_ns[KILO_PROF_FRAMES];	/* ring of the last frames' times. */
+	size_t frame_bytes[KILO_PROF_FRAMES];
+	size_t nframes;
+} profiler;
+
+typedef struct abuf {
+	char *b;
+	size_t len;
+	size_t cap;
+} abuf;
+
+#define ABUF_INIT {NULL, 0, 0}
+
 struct editor_config {
-	int cx, cy;
-	int rx;
-	int rowoff;	/* row offset - the row of the file the user is currently scrolled to. */
-	int coloff;	/* column offset - the column of the file the cursor is currently on. */
+	size_t cx, cy;
+	size_t rx;
+	size_t rowoff;	/* row offset - the row of the file the user is currently scrolled to. */
+	size_t coloff;	/* column offset - the column of the file the cursor is currently on. */
 	int screenrows;
 	int screencols;
-	int numrows;
-	erow *row;	/* pointer to the first element of an array of erows. */
+	size_t numrows;
+	rnode *rows;	/* root of the tree of rows. */
+	rnode *finger;	/* node of the last row looked up, so walking through a span does not descend the tree every time. */
+	size_t finger_start;	/* row number of the first row in finger. */
+	char *map;	/* contents of the opened file, mapped read-only. */
+	size_t mapsize;
+	size_t *lines;	/* offset in map of the start of each line of the file. */
+	size_t nlines;
+	erow *cache_head;	/* most recently drawn row. */
+	erow *cache_tail;	/* least recently drawn row, the first to be evicted. */
+	size_t cache_bytes;	/* bytes held by render and hl of all rows in the cache. */
+	struct editor_syntax *syntax;	/* NULL if the file isn't in any known language. */
+	/* The lex_state at the end of each row. Only rows below hl_valid are sure to be right.
+	 * Rows from hl_valid to hl_known were lexed before an edit at hl_valid, so they are
+	 * right again as soon as relexing from the edit reaches a row whose state didn't change.
+	 */
+	unsigned char *hl_state;
+	size_t hl_cap;
+	size_t hl_valid;
+	size_t hl_known;
+	lex_mark hl_lex;	/* how far the lexing of row hl_valid has got, a long row is lexed a slice at a time. */
+	/* the rows below hl_valid are lexed by a thread of their own, so the UI never waits for a big file. */
+	pthread_t hl_thread;
+	pthread_cond_t hl_cond;	/* signalled when there are rows to lex. */
+	int hl_waiting;	/* rows were drawn with guessed highlighting, wake the main thread when they can have it right. */
+	size_t hl_guess_row;	/* the last row whose state was guessed, NO_ROW if none is. */
+	int hl_guess_state;	/* the state it was guessed to start in. */
+	frame screen;	/* the frame being drawn. */
+	frame shadow;	/* the frame the terminal is currently showing. */
+	int shadow_valid;	/* 0 if we don't know what the terminal shows and have to redraw all of it. */
+	abuf out;	/* output of refresh_screen(), kept around so frames don't allocate. */
+	size_t frame_bytes;	/* bytes written to the terminal by the last refresh_screen(). */
+#ifdef KILO_DEBUG
+	size_t frame_allocs;	/* heap allocations made by the last refresh_screen(). */
+#endif
+#ifdef KILO_BENCH
+	size_t input_bytes;	/* bytes read from the terminal so far. */
+#endif
 	int dirty;	/* flag for whether file has been modified. */
 	char *filename;
-	char statusmsg[80];
+	char statusmsg[160];
 	time_t statusmsg_time;
 	struct termios orig_termios;
+	char inbuf[KILO_INPUT_SIZE];	/* input read from the terminal but not decoded into keys yet. */
+	int inpos;
+	int inlen;
+	int wakefd[2];	/* self-pipe, written to by signal handlers to wake up poll(). */
+	volatile sig_atomic_t winch;	/* set when the terminal has been resized. */
+	/* Worker threads may only touch the editor while holding lock. The main thread
+	 * holds it all the time, except while it is waiting for input.
+	 */
+	pthread_mutex_t lock;
+	int lock_wanted;	/* set while the main thread waits for lock, so workers step aside. */
+	search_query search;
+	match_table matches;
+	replace_job replace;
+	save_job save;
+	undo_log undo;
+	journal journal;
+	profiler prof;
+	int batch;	/* running a script on files with no terminal, see batch_main(). */
+	int tabstop;
 };
 
 struct editor_config E;
 
-typedef struct abuf {
-	char *b;
-	int len;
-} abuf;
 
-#define ABUF_INIT {NULL, 0}
+/* the line starts found in one chunk of a file. */
+typedef struct line_index {
+	const char *buf;
+	size_t start;	/* offset of the chunk in the file. */
+	size_t len;
+	size_t filesize;
+	size_t *lines;
+	size_t nlines;
+	size_t cap;
+} line_index;
+
+/*** filetypes ***/
+
+char *C_HL_extensions[] = {".c", ".h", ".cpp", ".hpp", ".cc", NULL};
+char *C_HL_keywords[] = {
+	"switch", "if", "while", "for", "break", "continue", "return", "else", "do", "goto",
+	"struct", "union", "typedef", "static", "extern", "enum", "class", "case", "default",
+	"sizeof", "volatile", "inline", "#include", "#define", "#ifdef", "#ifndef", "#if",
+	"#else", "#elif", "#endif",
+
+	"int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|", "void|",
+	"short|", "const|", "size_t|", "ssize_t|", NULL
+};
+
+char *PY_HL_extensions[] = {".py", NULL};
+char *PY_HL_keywords[] = {
+	"def", "class", "if", "elif", "else", "for", "while", "return", "import", "from",
+	"as", "with", "try", "except", "finally", "raise", "pass", "break", "continue",
+	"lambda", "yield", "in", "not", "and", "or", "is", "global", "del", "assert",
+
+	"None|", "True|", "False|", "self|", "int|", "str|", "float|", "list|", "dict|",
+	"tuple|", "set|", "bytes|", NULL
+};
+
+/* highlight database. */
+struct editor_syntax HLDB[] = {
+	{
+		"c",
+		C_HL_extensions,
+		C_HL_keywords,
+		"//", "/*", "*/",
+		HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+	},
+	{
+		"python",
+		PY_HL_extensions,
+		PY_HL_keywords,
+		"#", NULL, NULL,
+		HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+	},
+};
+
+#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
 /*** declarations ***/
 
 void die(const char *);
 void restore_termios_config(void);
 void raw_mode(void);
+void handle_winch(int);
+void input_init(void);
+void update_windowsize(void);
+int input_fill(int);
+int input_timeout(void);
+int input_wait(void);
+int input_pending(void);
+int input_byte(char *, int);
 int read_key(void);
-int row_cx_to_rx(erow *, int);
-int row_rx_to_cx(erow *, int);
+int decode_key(char);
+char *read_paste(size_t *);
+void editor_lock(void);
+void editor_unlock(void);
+void editor_wake(void);
+void worker_yield(void);
+long elapsed_ms(struct timespec *);
+unsigned int rope_rand(void);
+rnode *rope_node(void);
+size_t rope_weight(rnode *);
+size_t rope_count(rnode *);
+void rope_update(rnode *);
+void rope_split(rnode *, size_t, rnode **, rnode **);
+rnode *rope_merge(rnode *, rnode *);
+rnode *rope_find(size_t, size_t *);
+char *line_text(size_t, size_t *);
+void row_init(erow *, char *, size_t);
+void load_row(rnode *);
+rnode *row_isolate(size_t);
+erow *row_at(size_t);
+char *row_peek(size_t, size_t *);
+void row_read(size_t, lex_text *);
+size_t row_size(size_t);
+size_t tab_next(size_t, char);
+void tab_block(tab_span *, const char *, size_t);
+void tab_range(erow *, tab_span *, size_t, size_t);
+void tab_join(tab_span *, tab_span *, tab_span *);
+size_t tab_apply(tab_span *, size_t);
+tab_map *tab_map_build(erow *);
+void tab_map_free(erow *);
+tab_map *tab_map_get(erow *);
+void tab_map_edit(erow *, size_t, size_t, size_t);
+size_t row_cx_to_rx(erow *, size_t);
+size_t row_rx_to_cx(erow *, size_t);
+void cache_unlink(erow *);
+void cache_push(erow *);
+void cache_evict(erow *);
+void row_render(erow *, int, size_t, size_t);
+void row_render_long(erow *, int, size_t, size_t);
+void row_window(erow *, size_t, size_t);
 void update_row(erow *);
-void insert_row(int, char *, size_t);
+rnode *row_node(const char *, size_t);
+void insert_row(size_t, char *, size_t);
+void insert_row_tree(size_t, rnode *);
 void free_row(erow *);
-void delete_row(int);
-void row_insert_char(erow *, int, int);
-void row_delete_char(erow *, int);
+void free_row_tree(rnode *);
+void delete_rows(size_t, size_t);
+void delete_row(size_t);
+void row_gap(erow *, size_t, size_t);
+char *row_text(erow *);
+char row_char(erow *, size_t);
+void row_edit(erow *, size_t, size_t, const char *, size_t);
+void row_insert_char(erow *, size_t, int);
+void row_delete_char(erow *, size_t);
 void row_append_string(erow *, char *, size_t);
+void row_insert_string(erow *, size_t, const char *, size_t);
+void insert_last_row(void);
 void insert_char(int);
+size_t text_line_end(const char *, size_t, size_t, size_t *);
+void text_insert(size_t, size_t, const char *, size_t, size_t *, size_t *);
+void text_delete(size_t, size_t, size_t, size_t);
+void insert_text(const char *, size_t);
 void delete_char(void);
 void insert_newline(void);
+void editor_tabstop(void);
+size_t undo_op_size(size_t);
+size_t undo_last(void);
+void undo_reserve(size_t);
+int undo_coalesce(int, unsigned long, size_t, size_t, size_t, size_t, const char *, size_t);
+void undo_truncate(unsigned long);
+void undo_push(int, unsigned long, size_t, size_t, size_t, size_t, const char *, size_t);
+void undo_apply(undo_op *, int);
+void editor_undo(void);
+void editor_redo(void);
+void index_push(line_index *, size_t);
+void scan_newlines_memchr(line_index *, size_t);
+void scan_newlines_sse2(line_index *, size_t);
+void scan_newlines_avx2(line_index *, size_t);
+void scan_newlines(line_index *);
+void *index_thread(void *);
+size_t *build_line_index(const char *, size_t, size_t *);
+size_t *index_lines(const char *, size_t, int, size_t *);
 void editor_open(char *);
-char *rows_to_string(int *);
+int write_iov(int, struct iovec *, int);
+void iov_add(int, struct iovec *, int *, const char *, size_t, int *);
+ssize_t rows_write(int, save_state *);
+char *dir_of(const char *);
+void fsync_dir(const char *);
+ssize_t save_write(char *, const char *, save_state *);
+void save_poll(void);
+void save_wait(void);
 void editor_save(void);
+char *journal_name(const char *);
+int journal_create(const char *);
+void journal_add(int, size_t, size_t, size_t, size_t, const char *, size_t);
+void journal_write(int, const char *, size_t);
+void *journal_thread(void *);
+void journal_save_start(void);
+void journal_save_done(int);
+size_t journal_replay(const char *, size_t);
+void journal_start(void);
+void journal_remove(void);
+int regex_node_new(regex *, int, int, int);
+int regex_class_node(regex *, const unsigned char *);
+void regex_class_add(unsigned char *, int, int);
+int regex_class_escape(unsigned char *, int);
+int regex_escape_char(int);
+int regex_parse_class(regex *, const char **);
+int regex_parse_atom(regex *, const char **);
+int regex_parse_bound(regex *, const char **, int *, int *);
+int regex_parse_repeat(regex *, const char **);
+int regex_parse_cat(regex *, const char **);
+int regex_parse_alt(regex *, const char **);
+int regex_state_new(regex *);
+void regex_edge(regex *, int, int, int);
+void regex_compile_node(regex *, int, int, int);
+void regex_build_nfa(regex *, nfa *, int);
+int regex_class_byte(const unsigned char *);
+void regex_find_literal(regex *, int, char *, int *);
+void dfa_init(dfa *, nfa *, int);
+void dfa_flush(dfa *);
+void dfa_free(dfa *);
+void dfa_new_set(dfa *);
+void dfa_closure(dfa *, int, int *, int, int);
+int int_cmp(const void *, const void *);
+int dfa_state(dfa *, int);
+int dfa_start(dfa *, int);
+int dfa_next(dfa *, int, unsigned char);
+void regex_free(regex *);
+regex *regex_compile(const char *, const char **);
+size_t regex_windows(size_t);
+void regex_keep_state(search_scan *, dfa *, int);
+int regex_kept_state(search_scan *, dfa *, size_t);
+int regex_scan_back(regex *, search_scan *, lex_text *);
+void regex_mark(regex *, search_scan *, lex_text *, size_t);
+size_t regex_match_end(regex *, lex_text *, size_t);
+const char *search_mem_avx2(const char *, size_t, const char *, size_t);
+const char *search_mem_sse2(const char *, size_t, const char *, size_t);
+const char *search_mem(const char *, size_t, const char *, size_t);
+size_t text_find(lex_text *, size_t, size_t, const char *, size_t);
+void search_set(const char *, int);
+void search_skip_reset(void);
+void search_clear(void);
+void search_scan_reset(search_scan *, size_t);
+int search_step(search_scan *, lex_text *, size_t *, size_t *);
+int search_row(search_scan *, lex_text *, size_t *, size_t *);
+void match_push(match_table *, size_t, size_t, size_t);
+void *match_thread(void *);
+size_t match_next_row(match_table *, size_t);
+void match_scan_stop(int);
+void match_scan_start(void);
+int match_cmp(size_t, size_t, size_t, size_t);
+size_t match_lower_bound(size_t, size_t);
+int format_count(char *, size_t, size_t);
+int match_status(char *, size_t);
 void find_callback(char *, int);
-void editor_find(void);
-void ab_append(abuf *, const char *, int);
+void editor_find(int);
+size_t row_replace(replace_job *, size_t);
+void *replace_thread(void *);
+int replace_busy(void);
+void editor_replace(void);
+void ab_append(abuf *, const char *, size_t);
 void ab_free(abuf *);
+void ab_reset(abuf *);
+void screen_init(void);
+void screen_put(int, int, const char *, int, int);
+void screen_clear(int, int);
+int chars_plain(const char *, int);
+void screen_attr(abuf *, int, int *);
+void screen_move(abuf *, int, int);
+int screen_flush(abuf *);
 void refresh_screen(void);
 int get_cursor_pos(int *, int *);
 void editor_scroll(void);
 int get_windowsize(int *, int *);
-void draw_status(abuf *);
+void draw_status(void);
 void set_status_msg(const char *, ...);
-void draw_status_msg(abuf *);
-void update_syntax(erow *);
+void draw_status_msg(void);
+int is_separator(int);
+int text_match(lex_text *, size_t, const char *, size_t);
+size_t syntax_lex_span(lex_text *, size_t, size_t, lex_pos *, unsigned char *);
+int syntax_lex_end(lex_pos *);
+int syntax_lex(const char *, size_t, int, unsigned char *);
+void syntax_mark_row(erow *, int);
+int syntax_lex_row(size_t, int);
+size_t syntax_lex_next(size_t);
+int syntax_state_after(size_t, int, size_t *);
+int syntax_guess_state(size_t);
+int syntax_state_before(size_t);
+void *hl_thread(void *);
+void syntax_reserve(size_t);
+void syntax_invalidate(size_t, size_t, size_t);
+void select_syntax(void);
+void update_syntax(erow *, int);
+void row_patch(erow *, size_t, size_t, size_t);
 int syntax_to_color(int);
 char *editor_prompt(char *, void (*callback)(char *, int));
-void draw_rows(abuf *);
+void draw_rows(void);
 void move_cursor(int);
 void process_keypress(void);
+long long prof_now(void);
+long long prof_begin(void);
+void prof_end(int, long long, size_t);
+void prof_trace(char *);
+void prof_toggle(void);
+int prof_status(char *, size_t);
+void prof_dump(void);
+size_t batch_unescape(char *);
+const char *batch_find(const char *);
+const char *batch_command(char *);
+int batch_file(const char *, char **, size_t);
+int batch_usage(void);
+int batch_main(int, char **);
+#ifdef KILO_BENCH
+double bench_gbps(size_t, struct timespec *);
+double bench_search(const char *, int);
+int bench_main(int, char **);
+#endif
 void init_editor(void);
 
 /*** terminal ***/
 
+#ifdef KILO_DEBUG
+/* the parentheses keep the real allocator from being replaced by the macros. */
+void *debug_malloc(size_t n)
+{
+	alloc_count++;
+	return (malloc)(n);
+}
+
+void *debug_realloc(void *p, size_t n)
+{
+	alloc_count++;
+	return (realloc)(p, n);
+}
+#endif
+
 void die(const char *s)
 {
-	write(STDOUT_FILENO, "\x1b[2J", 4);
-	write(STDOUT_FILENO, "\x1b[H", 3);
+	if (!E.batch) {
+		write(STDOUT_FILENO, "\x1b[2J", 4);
+		write(STDOUT_FILENO, "\x1b[H", 3);
+	}
 	perror(s);
 	exit(1);
 }
 
 void restore_termios_config(void)
 {
+	write(STDOUT_FILENO, "\x1b[?2004l", 8);
 	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
 		die("tcsetattr");
 }
@@ -150,30 +923,174 @@ void raw_mode(void)
 	raw.c_cflag |= (CS8);
 	raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
 
-	/* set timeout for read */
+	/* set timeout for read, input is only read once poll() says some is waiting though. */
 	raw.c_cc[VMIN] = 0;	/* min number of bytes of input needed before read() can return. */
 	raw.c_cc[VTIME] = 1;	/* max time to wait before read() returns, in tenths of a question. */
 
 	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+
+	/* ask for bracketed paste, pasted text then comes between ESC[200~ and ESC[201~. */
+	write(STDOUT_FILENO, "\x1b[?2004h", 8);
+}
+
+/*** input events ***/
+/* Input is read from the terminal in as large chunks as are waiting and decoded into keys
+ * from E.inbuf, so a burst of keys (a paste, key repeat) is applied before the next frame.
+ * poll() also watches a self-pipe, so that resizing the window wakes the editor up.
+ */
+
+void handle_winch(int sig)
+{
+	(void) sig;
+	int saved_errno = errno;
+	E.winch = 1;
+	write(E.wakefd[1], "", 1);
+	errno = saved_errno;
+}
+
+void input_init(void)
+{
+	if (pipe(E.wakefd) == -1) die("pipe");
+	fcntl(E.wakefd[0], F_SETFL, O_NONBLOCK);
+	fcntl(E.wakefd[1], F_SETFL, O_NONBLOCK);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_winch;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	if (sigaction(SIGWINCH, &sa, NULL) == -1) die("sigaction");
+}
+
+void update_windowsize(void)
+{
+	if (get_windowsize(&E.screenrows, &E.screencols) == -1) die("get_windowsize");
+	E.screenrows -= 2;
+	screen_init();
+}
+
+/* wait up to timeout milliseconds (-1 for ever) for input or an event, and read whatever
+ * input is waiting. Returns the number of bytes read.
+ */
+int input_fill(int timeout)
+{
+	struct pollfd fds[2];
+	fds[0].fd = STDIN_FILENO;
+	fds[0].events = POLLIN;
+	fds[1].fd = E.wakefd[0];
+	fds[1].events = POLLIN;
+
+	/* let worker threads have the editor while we sleep. */
+	editor_unlock();
+	int n = poll(fds, 2, timeout);
+	editor_lock();
+	if (n == -1 && errno != EINTR) die("poll");
+
+	if (n > 0 && (fds[1].revents & POLLIN)) {
+		char drain[64];
+		while (read(E.wakefd[0], drain, sizeof(drain)) > 0);
+	}
+	if (E.winch) {
+		E.winch = 0;
+		update_windowsize();
+	}
+	if (E.save.pid) save_poll();
+
+	int nread = 0;
+	if (n > 0 && fds[0].revents) {
+		/* move what is left of the last read to the front to make room. */
+		if (E.inpos > 0) {
+			memmove(E.inbuf, &E.inbuf[E.inpos], E.inlen - E.inpos);
+			E.inlen -= E.inpos;
+			E.inpos = 0;
+		}
+		if (E.inlen < KILO_INPUT_SIZE) {
+			nread = read(STDIN_FILENO, &E.inbuf[E.inlen], KILO_INPUT_SIZE - E.inlen);
+			if (nread == -1 && errno != EAGAIN && errno != EINTR) die("read");
+			if (nread == 0 && (fds[0].revents & POLLHUP)) die("read");
+			if (nread < 0) nread = 0;
+			E.inlen += nread;
+#ifdef KILO_BENCH
+			E.input_bytes += nread;
+#endif
+		}
+	}
+	return nread;
+}
+
+/* milliseconds until the screen has to be redrawn without any input, -1 if never. */
+int input_timeout(void)
+{
+	/* the status message disappears after 5 seconds. */
+	if (E.statusmsg[0] == '\0') return -1;
+	time_t left = E.statusmsg_time + 5 - time(NULL);
+	if (left <= 0) return -1;
+	return left * 1000;
+}
+
+/* sleep until there is input or something else to redraw for. */
+int input_wait(void)
+{
+	return input_fill(input_timeout());
+}
+
+int input_pending(void)
+{
+	return E.inpos < E.inlen;
+}
+
+/* get the next byte of input, waiting up to timeout milliseconds (-1 for ever) for it.
+ * Returns 0 if none came in time. A wake from a worker thread or a resize ends the poll
+ * early, so keep waiting out whatever is left of the timeout.
+ */
+int input_byte(char *c, int timeout)
+{
+	long long deadline = timeout == -1 ? 0 : prof_now() + timeout * 1000000LL;
+	while (!input_pending()) {
+		int left = -1;
+		if (timeout != -1) {
+			long long ns = deadline - prof_now();
+			if (ns <= 0) return 0;
+			left = (ns + 999999) / 1000000;
+		}
+		input_fill(left);
+	}
+	*c = E.inbuf[E.inpos++];
+	return 1;
 }
 
 int read_key(void)
 {
-	int nread;
 	char c;
-	while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-		if (nread == -1 && errno != EAGAIN) die("read");
-	}
+	input_byte(&c, -1);
+
+	/* waiting for the key is idle time, only making sense of it is timed. */
+	long long start = prof_begin();
+	int key = decode_key(c);
+	prof_end(PROF_READ_KEY, start, 0);
+	return key;
+}
 
+/* the key that starts with c, reading the rest of an escape sequence. */
+int decode_key(char c)
+{
 	if (c == '\x1b') {
 		char seq[3];
 
-		if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-		if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+		if (!input_byte(&seq[0], KILO_ESC_TIMEOUT)) return '\x1b';
+		if (!input_byte(&seq[1], KILO_ESC_TIMEOUT)) return '\x1b';
 
 		if (seq[0] == '[') {
 			if (seq[1] >= '0' && seq[1] <= '9') {
-				if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+				if (!input_byte(&seq[2], KILO_ESC_TIMEOUT)) return '\x1b';
+				if (seq[1] == '2' && seq[2] == '0') {
+					/* ESC[200~ starts a bracketed paste. */
+					char rest[2];
+					if (!input_byte(&rest[0], KILO_ESC_TIMEOUT)) return '\x1b';
+					if (!input_byte(&rest[1], KILO_ESC_TIMEOUT)) return '\x1b';
+					if (rest[0] == '0' && rest[1] == '~') return PASTE_START;
+					return '\x1b';
+				}
 				if (seq[2] == '~') {
 					switch (seq[1]) {
 						case '1': return HOME_KEY;
@@ -208,328 +1125,3060 @@ int read_key(void)
 	}
 }
 
-/*** row operations ***/
-
-int row_cx_to_rx(erow *row, int cx)
+/* read the text of a bracketed paste, up to the ESC[201~ the terminal sends after it.
+ * Returns a buffer holding the text and stores its length in len.
+ */
+char *read_paste(size_t *len)
 {
-	int rx = 0;
-	int j;
-	for (j = 0; j < cx; j++) {
-		if (row->chars[j] == '\t') rx+= (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
-		rx++;
+	size_t cap = 1024;
+	size_t n = 0;
+	char *buf = malloc(cap);
+	char c;
+	while (input_byte(&c, -1)) {
+		if (n == cap) {
+			cap *= 2;
+			buf = realloc(buf, cap);
+		}
+		buf[n++] = c;
+		if (n >= 6 && memcmp(&buf[n - 6], "\x1b[201~", 6) == 0) {
+			n -= 6;
+			break;
+		}
 	}
-	return rx;
+	*len = n;
+	return buf;
 }
 
-int row_rx_to_cx(erow *row, int rx)
-{
-	int cur_rx = 0;
-	int cx;
-	for (cx = 0; cx < row->size; cx++) {
-		if (row->chars[cx] == '\t') cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
-		cur_rx++;
+/*** threads ***/
 
-		if (cur_rx > rx) return cx;
-	}
-	return cx;
+/* take the editor lock on the main thread, workers let it have the lock at their next batch. */
+void editor_lock(void)
+{
+	__atomic_store_n(&E.lock_wanted, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&E.lock);
+	__atomic_store_n(&E.lock_wanted, 0, __ATOMIC_SEQ_CST);
 }
 
-void update_row(erow *row)
+void editor_unlock(void)
 {
-	int tabs = 0;
-	int j;
-	/* count the number of tabs in the current row. */
-	for (j = 0; j < row->size; j++)
-		if (row->chars[j] == '\t') tabs++;
-
-	free(row->render);
-	row->render = malloc(row->size + tabs * (KILO_TAB_STOP - 1) +  1); /* include space for tabs. */
-
-	int idx = 0;
-	for (j = 0; j < row->size; j++) {
-		/* replace tab character with spaces. */
-		if (row->chars[j] == '\t') {
-			row->render[idx++] = ' ';
-			/* append spaces until we get to a tab stop, which is a column divisible by 8. */
-			while (idx % 8 !=0) row->render[idx++] = ' ';
-		} else {
-			row->render[idx++] = row->chars[j];
-		}
-	}
-
-	row->render[idx] = '\0';
-	row->rsize = idx;
-
-	update_syntax(row);
+	pthread_mutex_unlock(&E.lock);
 }
 
-void insert_row(int at, char *s, size_t len)
+/* wake up the main thread so it draws a new frame, if there is one waiting for input. */
+void editor_wake(void)
 {
-	if (at < 0 || at > E.numrows) return;
+	if (E.wakefd[1] == -1) return;
+	write(E.wakefd[1], "", 1);
+}
 
-	E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-	memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+/* called by workers holding the lock between two batches of work, to let the main thread in. */
+void worker_yield(void)
+{
+	pthread_mutex_unlock(&E.lock);
+	while (__atomic_load_n(&E.lock_wanted, __ATOMIC_SEQ_CST)) sched_yield();
+	pthread_mutex_lock(&E.lock);
+}
 
-	E.row[at].size = len;
-	E.row[at].chars = malloc(len + 1);
-	memcpy(E.row[at].chars, s, len);
-	E.row[at].chars[len] = '\0';
+/* milliseconds since *since, which is moved to now if any have passed. */
+long elapsed_ms(struct timespec *since)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long ms = (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+	if (ms > 0) *since = now;
+	return ms;
+}
 
-	E.row[at].rsize = 0;
-	E.row[at].render = NULL;
-	E.row[at].hl = NULL;
-	update_row(&E.row[at]);
+/*** row storage ***/
 
-	E.numrows++;
-	E.dirty++;
+unsigned int rope_rand(void)
+{
+	/* xorshift, only used to keep the tree balanced so it does not need to be good. */
+	static unsigned int state = 2463534242u;
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
 }
 
-void free_row(erow *row)
+rnode *rope_node(void)
 {
-	free(row->render);
-	free(row->chars);
-	free(row->hl);
+	rnode *node = malloc(sizeof(rnode));
+	node->span = 0;
+	node->line = 0;
+	node->count = 1;
+	node->prio = rope_rand();
+	node->left = NULL;
+	node->right = NULL;
+	return node;
 }
 
-void delete_row(int at)
+/* number of rows held by the node itself. */
+size_t rope_weight(rnode *t)
 {
-	if (at < 0 || at >= E.numrows) return;
-	free_row(&E.row[at]);
-	memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-	E.numrows--;
-	E.dirty++;
+	return t->span ? t->span : 1;
 }
 
-void row_insert_char(erow *row, int at, int c)
+size_t rope_count(rnode *t)
 {
-	if (at < 0 || at > row->size) at = row->size;
-	row->chars = realloc(row->chars, row->size + 2);
-	memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-	row->size++;
-	row->chars[at] = c;
-	update_row(row);
-	E.dirty++;
+	return t ? t->count : 0;
 }
 
-void row_delete_char(erow *row, int at)
+void rope_update(rnode *t)
 {
-	if (at < 0 || at >= row->size) return;
-	memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-	row->size--;
-	update_row(row);
-	E.dirty++;
+	t->count = rope_weight(t) + rope_count(t->left) + rope_count(t->right);
 }
 
-void row_append_string(erow *row, char *s, size_t len)
+/* split the tree t into l, holding its first k rows, and r, holding the rest. */
+void rope_split(rnode *t, size_t k, rnode **l, rnode **r)
 {
-	row->chars = realloc(row->chars, row->size + len + 1);
-	memcpy(&row->chars[row->size], s, len);
-	row->size += len;
-	row->chars[row->size] = '\0';
-	update_row(row);
-	E.dirty++;
-}
+	E.finger = NULL;
+	if (t == NULL) {
+		*l = *r = NULL;
+		return;
+	}
 
-/*** editor operations ***/
+	size_t lcount = rope_count(t->left);
+	size_t weight = rope_weight(t);
+	if (k <= lcount) {
+		rope_split(t->left, k, l, &t->left);
+		*r = t;
+	} else if (k >= lcount + weight) {
+		rope_split(t->right, k - lcount - weight, &t->right, r);
+		*l = t;
+	} else {
+		/* the cut falls inside this span, so the lines after it move to a new node. */
+		rnode *tail = rope_node();
+		tail->span = weight - (k - lcount);
+		tail->line = t->line + (k - lcount);
+		rope_update(tail);
+		t->span = k - lcount;
 
-void insert_char(int c)
-{
-	if (E.cy == E.numrows) {
-		insert_row(E.numrows, "", 0);
+		rnode *right = t->right;
+		t->right = NULL;
+		*l = t;
+		*r = rope_merge(tail, right);
 	}
-	row_insert_char(&E.row[E.cy], E.cx, c);
-	E.cx++;
+	rope_update(t);
 }
 
-void delete_char(void)
+/* join two trees, every row of l comes before every row of r. */
+rnode *rope_merge(rnode *l, rnode *r)
 {
-	if (E.cy == E.numrows) return;
-	if (E.cx == 0 && E.cy == 0) return;
+	E.finger = NULL;
+	if (l == NULL) return r;
+	if (r == NULL) return l;
 
-	erow *row = &E.row[E.cy];
-	if (E.cx > 0) {
-		row_delete_char(row, E.cx - 1);
-		E.cx--;
+	if (l->prio > r->prio) {
+		l->right = rope_merge(l->right, r);
+		rope_update(l);
+		return l;
 	} else {
-		E.cx = E.row[E.cy - 1].size;
-		row_append_string(&E.row[E.cy - 1], row->chars, row->size);
-		delete_row(E.cy);
-		E.cy--;
+		r->left = rope_merge(l, r->left);
+		rope_update(r);
+		return r;
 	}
 }
 
-void insert_newline(void)
+/* return the node holding row at and store the number of its first row in start. */
+rnode *rope_find(size_t at, size_t *start)
 {
-	if (E.cx == 0) {
-		insert_row(E.cy, "", 0);
-	} else {
-		erow *row = &E.row[E.cy];
-		insert_row(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-		row = &E.row[E.cy];
-		row->size = E.cx;
-		row->chars[row->size] = '\0';
-		update_row(row);
+	if (E.finger && at >= E.finger_start && at < E.finger_start + rope_weight(E.finger)) {
+		*start = E.finger_start;
+		return E.finger;
 	}
 
-	E.cy++;
-	E.cx = 0;
+	rnode *t = E.rows;
+	size_t base = 0;
+	while (t) {
+		size_t lcount = rope_count(t->left);
+		if (at < base + lcount) {
+			t = t->left;
+		} else if (at < base + lcount + rope_weight(t)) {
+			E.finger = t;
+			E.finger_start = base + lcount;
+			*start = E.finger_start;
+			return t;
+		} else {
+			base += lcount + rope_weight(t);
+			t = t->right;
+		}
+	}
+	return NULL;
 }
 
-/*** file IO ***/
+/* return the text of line of the mapped file without its line terminator. */
+char *line_text(size_t line, size_t *len)
+{
+	size_t start = E.lines[line];
+	size_t end = (line + 1 < E.nlines) ? E.lines[line + 1] : E.mapsize;
+	while (end > start && (E.map[end - 1] == '\n' || E.map[end - 1] == '\r'))
+		end--;
+	*len = end - start;
+	return &E.map[start];
+}
 
-void editor_open(char *filename)
+/* make row hold the len bytes of chars, which have to be followed by a '\0' and now belong to the row. */
+void row_init(erow *row, char *chars, size_t len)
 {
-	free(E.filename);
-	E.filename = strdup(filename);
-	FILE *fp = fopen(filename, "r");
-	if (!fp) die("fopen");
+	row->size = len;
+	row->chars = chars;
+	row->gap = len;
+	row->gaplen = 0;
+	row->rsize = 0;
+	row->render = NULL;
+	row->hl = NULL;
+	row->rx0 = 0;
+	row->hl_in = LEX_NORMAL;
+	row->hl_out = LEX_NORMAL;
+	row->tabs = NULL;
+	row->marks = NULL;
+	row->nmarks = 0;
+	row->cache_prev = NULL;
+	row->cache_next = NULL;
+}
 
-	char *line = NULL;
-	size_t linecap = 0;
-	ssize_t linelen;
-	while ((linelen = getline(&line, &linecap, fp)) != -1) {
-		while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-			linelen--;
-		insert_row(E.numrows, line, linelen);
-	}
-	free(line);
-	fclose(fp);
-	E.dirty = 0;
+/* turn a node spanning a single unloaded line into a proper erow. */
+void load_row(rnode *node)
+{
+	size_t len;
+	char *s = line_text(node->line, &len);
+	char *chars = malloc(len + 1);
+	memcpy(chars, s, len);
+	chars[len] = '\0';
+	row_init(&node->row, chars, len);
+	node->span = 0;
 }
 
-char *rows_to_string(int *buflen)
+/* return the node of row at, cut out of its span on its own if it is still unloaded. */
+rnode *row_isolate(size_t at)
 {
-	int totlen = 0;
-	int j;
-	for (j = 0; j < E.numrows; j++) {
-		totlen += E.row[j].size + 1;
-	}
-	*buflen = totlen;
+	size_t start;
+	rnode *node = rope_find(at, &start);
+	if (node->span == 0) return node;
 
-	char *buf = malloc(totlen);
-	char *p = buf;
-	for (j = 0; j < E.numrows; j++) {
-		memcpy(p, E.row[j].chars, E.row[j].size);
-		p += E.row[j].size;
-		*p = '\n';
-		p++;
-	}
+	/* cut the row out of its span and put it back in its place as a node of its own. */
+	rnode *l, *mid, *r;
+	rope_split(E.rows, at, &l, &r);
+	rope_split(r, 1, &mid, &r);
+	E.rows = rope_merge(rope_merge(l, mid), r);
+	return mid;
+}
 
-	return buf;
+/* return the row at position at, or NULL if there is no such row.
+ * If the row has not been loaded from the file yet, it is loaded now.
+ */
+erow *row_at(size_t at)
+{
+	if (at >= E.numrows) return NULL;
+
+	rnode *node = row_isolate(at);
+	if (node->span) load_row(node);
+	return &node->row;
 }
 
-void editor_save(void)
+/* return the characters of row at in one piece without loading it, storing their count in len.
+ * A loaded row has its gap closed for this, which costs as much as the chars after it, so
+ * whatever only reads the row goes through row_read() instead.
+ */
+char *row_peek(size_t at, size_t *len)
 {
-	if (E.filename == NULL) {
-		E.filename = editor_prompt("Save as: %s", NULL);
-		if (E.filename == NULL) {
-			set_status_msg("Save aborted");
-			return;
-		}
+	size_t start;
+	rnode *node = rope_find(at, &start);
+	if (node->span == 0) {
+		*len = node->row.size;
+		return row_text(&node->row);
 	}
+	return line_text(node->line + (at - start), len);
+}
 
-	int len;
-	char *buf = rows_to_string(&len);
-
-	/* O_RDWR - means open it for reading and writing.
-	 * O_CREAT - means create a new file if it doesn't already exist.
-	 * Permissions 0644 means owner of the file can read and write, everyone else read.
-	 */
-	int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-	if (fd != -1) {
-		/* ftruncate sets the file's size to the specified length. */
-		if (ftruncate(fd, len) != -1) {
-			if (write(fd, buf, len) == len) {
-				close(fd);
-				free(buf);
-				E.dirty = 0;
-				set_status_msg("%d bytes written to disk", len);
-				return;
-			}
-		}
-		close(fd);
+/* point t at the characters of row at as they are kept, without loading it or moving its gap. */
+void row_read(size_t at, lex_text *t)
+{
+	size_t start;
+	rnode *node = rope_find(at, &start);
+	if (node->span == 0) {
+		erow *row = &node->row;
+		t->s = row->chars;
+		t->len = row->size;
+		t->gap = row->gap;
+		t->gaplen = row->gaplen;
+		return;
 	}
+	t->s = line_text(node->line + (at - start), &t->len);
+	t->gap = t->len;
+	t->gaplen = 0;
+}
 
-	free(buf);
-	set_status_msg("Can't save! I/O error: %s", strerror(errno));
+/* the number of characters in row at, without loading it. */
+size_t row_size(size_t at)
+{
+	size_t start;
+	rnode *node = rope_find(at, &start);
+	if (node->span == 0) return node->row.size;
+	size_t len;
+	line_text(node->line + (at - start), &len);
+	return len;
 }
 
-/*** find ***/
+/*** row operations ***/
 
-void find_callback(char *query, int key)
+/* the render column after char c, drawn at column rx. */
+size_t tab_next(size_t rx, char c)
 {
-	static int last_match = -1;
-	static int direction = 1;
+	if (c == '\t') return rx - rx % E.tabstop + E.tabstop;
+	return rx + 1;
+}
 
-	static int saved_hl_line;
-	static char *saved_hl = NULL;
+/* work out how the len chars of s move the render column. */
+void tab_block(tab_span *span, const char *s, size_t len)
+{
+	const char *tab = memchr(s, '\t', len);
+	span->len = len;
+	span->tab = tab != NULL;
+	span->pre = tab ? (size_t) (tab - s) : len;
+	span->post = 0;
+	if (tab == NULL) return;
+	size_t j;
+	for (j = tab - s + 1; j < len; j++) span->post = tab_next(span->post, s[j]);
+}
 
-	if (saved_hl) {
-		/* restore the saved hl. */
-		memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-		free(saved_hl);
-		saved_hl = NULL;
+/* work out how the len chars of row from at on move the render column, the gap may be in the middle of them. */
+void tab_range(erow *row, tab_span *span, size_t at, size_t len)
+{
+	if (at + len <= row->gap || at >= row->gap) {
+		tab_block(span, &row->chars[(at < row->gap) ? at : at + row->gaplen], len);
+		return;
 	}
+	tab_span a, b;
+	tab_block(&a, &row->chars[at], row->gap - at);
+	tab_block(&b, &row->chars[row->gap + row->gaplen], at + len - row->gap);
+	tab_join(span, &a, &b);
+}
 
-	if (key == '\r' || key == '\x1b') {
-		/* reset values before canceling. */
-		last_match = -1;
-		direction = 1;
-		return;
-	} else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-		direction = 1;
+/* the run of a followed by b. */
+void tab_join(tab_span *to, tab_span *a, tab_span *b)
+{
+	to->len = a->len + b->len;
+	to->tab = a->tab || b->tab;
+	if (!a->tab) {
+		to->pre = a->pre + b->pre;
+		to->post = b->post;
+	} else if (!b->tab) {
+		to->pre = a->pre;
+		to->post = a->post + b->pre;
+	} else {
+		/* b's tab is the same distance from a stop wherever a's tab ended. */
+		to->pre = a->pre;
+		to->post = tab_next(a->post + b->pre, '\t') + b->post;
+	}
+}
+
+/* the render column a run that starts at column x ends at. */
+size_t tab_apply(tab_span *span, size_t x)
+{
+	if (!span->tab) return x + span->pre;
+	return tab_next(x + span->pre, '\t') + span->post;
+}
+
+tab_map *tab_map_build(erow *row)
+{
+	tab_map *map = malloc(sizeof(tab_map));
+	size_t blocks = row->size / KILO_TAB_BLOCK + 1;
+	map->tabstop = E.tabstop;
+	map->leaves = 1;
+	while (map->leaves < blocks) map->leaves *= 2;
+	map->tree = calloc(map->leaves * 2, sizeof(tab_span));
+
+	size_t i;
+	for (i = 0; i < blocks; i++) {
+		size_t start = i * KILO_TAB_BLOCK;
+		size_t len = row->size - start < KILO_TAB_BLOCK ? row->size - start : KILO_TAB_BLOCK;
+		tab_range(row, &map->tree[map->leaves + i], start, len);
+	}
+	for (i = map->leaves - 1; i > 0; i--) tab_join(&map->tree[i], &map->tree[2 * i], &map->tree[2 * i + 1]);
+	return map;
+}
+
+void tab_map_free(erow *row)
+{
+	if (row->tabs == NULL) return;
+	free(row->tabs->tree);
+	free(row->tabs);
+	row->tabs = NULL;
+}
+
+/* the tab map of row, NULL if it is short enough to just be walked. */
+tab_map *tab_map_get(erow *row)
+{
+	if (row->size < KILO_LONG_ROW) {
+		tab_map_free(row);
+		return NULL;
+	}
+	if (row->tabs && row->tabs->tabstop != E.tabstop) tab_map_free(row);
+	if (row->tabs == NULL) row->tabs = tab_map_build(row);
+	return row->tabs;
+}
+
+/* keep the tab map of row up to date after removed chars at at were replaced by added ones.
+ * Only the block the edit falls in is looked at again, unless it spans blocks or grows too big,
+ * in which case the map is dropped and built again when it is next needed.
+ */
+void tab_map_edit(erow *row, size_t at, size_t removed, size_t added)
+{
+	tab_map *map = row->tabs;
+	if (map == NULL) return;
+
+	size_t node = 1, base = 0;
+	while (node < map->leaves) {
+		node *= 2;
+		if (at >= base + map->tree[node].len) {
+			base += map->tree[node].len;
+			node++;
+		}
+	}
+	tab_span *leaf = &map->tree[node];
+	size_t len = leaf->len - removed + added;
+	if (map->tabstop != E.tabstop || at + removed > base + leaf->len || len > 2 * KILO_TAB_BLOCK) {
+		tab_map_free(row);
+		return;
+	}
+	tab_range(row, leaf, base, len);
+	for (node /= 2; node > 0; node /= 2)
+		tab_join(&map->tree[node], &map->tree[2 * node], &map->tree[2 * node + 1]);
+}
+
+size_t row_cx_to_rx(erow *row, size_t cx)
+{
+	size_t rx = 0;
+	size_t j = 0;
+	tab_map *map = tab_map_get(row);
+	if (map) {
+		if (cx >= row->size) return tab_apply(&map->tree[1], 0);
+		/* add up the blocks before the one cx is in. */
+		size_t node = 1;
+		while (node < map->leaves) {
+			node *= 2;
+			if (cx >= j + map->tree[node].len) {
+				rx = tab_apply(&map->tree[node], rx);
+				j += map->tree[node].len;
+				node++;
+			}
+		}
+	}
+	for (; j < cx; j++) rx = tab_next(rx, row_char(row, j));
+	return rx;
+}
+
+size_t row_rx_to_cx(erow *row, size_t rx)
+{
+	size_t cur_rx = 0;
+	size_t cx = 0;
+	tab_map *map = tab_map_get(row);
+	if (map) {
+		if (rx >= tab_apply(&map->tree[1], 0)) return row->size;
+		/* skip the blocks that end at or before rx. */
+		size_t node = 1;
+		while (node < map->leaves) {
+			node *= 2;
+			size_t end = tab_apply(&map->tree[node], cur_rx);
+			if (rx >= end) {
+				cur_rx = end;
+				cx += map->tree[node].len;
+				node++;
+			}
+		}
+	}
+	for (; cx < row->size; cx++) {
+		cur_rx = tab_next(cur_rx, row_char(row, cx));
+
+		if (cur_rx > rx) return cx;
+	}
+	return cx;
+}
+
+void cache_unlink(erow *row)
+{
+	if (row->cache_prev) row->cache_prev->cache_next = row->cache_next;
+	else E.cache_head = row->cache_next;
+	if (row->cache_next) row->cache_next->cache_prev = row->cache_prev;
+	else E.cache_tail = row->cache_prev;
+	row->cache_prev = row->cache_next = NULL;
+}
+
+void cache_push(erow *row)
+{
+	row->cache_prev = NULL;
+	row->cache_next = E.cache_head;
+	if (E.cache_head) E.cache_head->cache_prev = row;
+	else E.cache_tail = row;
+	E.cache_head = row;
+}
+
+/* drop the render cache of the least recently drawn rows until we are within budget again. */
+void cache_evict(erow *keep)
+{
+	while (E.cache_bytes > KILO_CACHE_BUDGET && E.cache_tail && E.cache_tail != keep)
+		update_row(E.cache_tail);
+}
+
+/* fill the render and hl cache of row if it is empty, state is the lex_state the row starts in.
+ * The columns from from to to are about to be drawn, which only matters to long rows.
+ */
+void row_render(erow *row, int state, size_t from, size_t to)
+{
+	if (row->size >= KILO_LONG_ROW) {
+		row_render_long(row, state, from, to);
+		return;
+	}
+	if (row->render) {
+		/* an edit above may have opened or closed a comment, which only changes hl. */
+		if (row->hl_in != state) update_syntax(row, state);
+		/* move it to the front so it is evicted last. */
+		cache_unlink(row);
+		cache_push(row);
+		return;
+	}
+
+	long long start = prof_begin();
+	row_text(row);
+	size_t tabs = 0;
+	size_t j;
+	/* count the number of tabs in the current row. */
+	for (j = 0; j < row->size; j++)
+		if (row->chars[j] == '\t') tabs++;
+
+	row->render = malloc(row->size + tabs * (E.tabstop - 1) +  1); /* include space for tabs. */
+
+	size_t idx = 0;
+	for (j = 0; j < row->size; j++) {
+		/* replace tab character with spaces. */
+		if (row->chars[j] == '\t') {
+			row->render[idx++] = ' ';
+			/* append spaces until we get to a tab stop. */
+			while (idx % E.tabstop != 0) row->render[idx++] = ' ';
+		} else {
+			row->render[idx++] = row->chars[j];
+		}
+	}
+
+	row->render[idx] = '\0';
+	row->rsize = idx;
+
+	update_syntax(row, state);
+
+	E.cache_bytes += row->rsize * 2 + 1;
+	cache_push(row);
+	cache_evict(row);
+	prof_end(PROF_ROW_RENDER, start, 0);
+}
+
+/* The render and hl of a long row are a window of its columns, as wide as the screen and KILO_WINDOW_MARGIN more
+ * on either side, so scrolling along it only costs as much as what is drawn. The window is lexed from the last mark
+ * before it, the marks are found once by lexing the whole row without keeping its hl.
+ */
+void row_render_long(erow *row, int state, size_t from, size_t to)
+{
+	size_t width = row_cx_to_rx(row, row->size);
+	if (to > width) to = width;
+	if (row->render && row->hl_in == state && from >= row->rx0 && to <= row->rx0 + row->rsize) {
+		cache_unlink(row);
+		cache_push(row);
+		return;
+	}
+
+	long long start = prof_begin();
+	int cached = row->render != NULL;
+	if (!cached || row->hl_in != state) syntax_mark_row(row, state);
+	row_window(row, (from > KILO_WINDOW_MARGIN) ? from - KILO_WINDOW_MARGIN : 0, to + KILO_WINDOW_MARGIN);
+	if (cached) cache_unlink(row);
+	cache_push(row);
+	cache_evict(row);
+	prof_end(PROF_ROW_RENDER, start, 0);
+}
+
+/* render the columns from from to to of a long row, as many of them as it has, starting at a char. */
+void row_window(erow *row, size_t from, size_t to)
+{
+	size_t cx = row_rx_to_cx(row, from);
+	size_t end = row_rx_to_cx(row, to);
+	if (end < row->size) end++;
+	size_t x = row_cx_to_rx(row, cx);
+
+	/* lex from the last mark at or before cx. */
+	size_t lo = 0, hi = row->nmarks;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (row->marks[mid].at <= cx) lo = mid + 1;
+		else hi = mid;
+	}
+	size_t mark = lo ? row->marks[lo - 1].at : 0;
+	lex_pos pos = {row->hl_in, 1, 0, 0};
+	if (lo) pos = row->marks[lo - 1].pos;
+	unsigned char *lexed = malloc(end - mark + KILO_LEX_REACH);
+	lex_text t = {row->chars, row->size, row->gap, row->gaplen};
+	if (row->hl_in == LEX_UNKNOWN) memset(lexed, HL_NORMAL, end - mark);
+	else syntax_lex_span(&t, mark, end, &pos, lexed);
+
+	size_t rsize = row_cx_to_rx(row, end) - x;
+	if (row->render) E.cache_bytes -= row->rsize * 2 + 1;
+	row->render = realloc(row->render, rsize + 1);
+	row->hl = realloc(row->hl, rsize);
+	size_t j, idx = 0;
+	for (j = cx; j < end; j++) {
+		char c = row_char(row, j);
+		size_t next = tab_next(x + idx, c) - x;
+		memset(&row->render[idx], (c == '\t') ? ' ' : c, next - idx);
+		memset(&row->hl[idx], lexed[j - mark], next - idx);
+		idx = next;
+	}
+	row->render[rsize] = '\0';
+	row->rsize = rsize;
+	row->rx0 = x;
+	E.cache_bytes += row->rsize * 2 + 1;
+	free(lexed);
+}
+
+/* the characters of row changed, so throw away its render cache. */
+void update_row(erow *row)
+{
+	if (row->render == NULL) return;
+
+	cache_unlink(row);
+	E.cache_bytes -= row->rsize * 2 + 1;
+	free(row->render);
+	free(row->hl);
+	free(row->marks);
+	row->render = NULL;
+	row->hl = NULL;
+	row->marks = NULL;
+	row->nmarks = 0;
+	row->rsize = 0;
+	row->rx0 = 0;
+}
+
+/* return a new tree node holding a row with the len characters of s. */
+rnode *row_node(const char *s, size_t len)
+{
+	rnode *node = rope_node();
+	char *chars = malloc(len + 1);
+	memcpy(chars, s, len);
+	chars[len] = '\0';
+	row_init(&node->row, chars, len);
+	return node;
+}
+
+void insert_row(size_t at, char *s, size_t len)
+{
+	if (at > E.numrows) return;
+	insert_row_tree(at, row_node(s, len));
+}
+
+/* insert all the rows of the tree t in front of row at. */
+void insert_row_tree(size_t at, rnode *t)
+{
+	/* cut the tree where the new rows go and glue it back together around them. */
+	rnode *l, *r;
+	rope_split(E.rows, at, &l, &r);
+	E.numrows += rope_count(t);
+	E.rows = rope_merge(rope_merge(l, t), r);
+	syntax_invalidate(at, 0, rope_count(t));
+	/* rows inserted above a running replace don't get looked at. */
+	if (E.replace.active && at < E.replace.row) E.replace.row += rope_count(t);
+	E.dirty++;
+}
+
+void free_row(erow *row)
+{
+	update_row(row);
+	tab_map_free(row);
+	free(row->chars);
+}
+
+/* free all the nodes of the tree t and the rows they hold. */
+void free_row_tree(rnode *t)
+{
+	if (t == NULL) return;
+	free_row_tree(t->left);
+	free_row_tree(t->right);
+	if (t->span == 0) free_row(&t->row);
+	free(t);
+}
+
+/* delete n rows starting with row at, cutting them out of the tree in one go. */
+void delete_rows(size_t at, size_t n)
+{
+	if (at >= E.numrows || n == 0) return;
+	if (n > E.numrows - at) n = E.numrows - at;
+
+	rnode *l, *mid, *r;
+	rope_split(E.rows, at, &l, &r);
+	rope_split(r, n, &mid, &r);
+	free_row_tree(mid);
+	E.rows = rope_merge(l, r);
+	syntax_invalidate(at, n, 0);
+
+	E.numrows -= n;
+	if (E.replace.active && at < E.replace.row) E.replace.row -= (E.replace.row - at < n) ? E.replace.row - at : n;
+	E.dirty++;
+}
+
+void delete_row(size_t at)
+{
+	delete_rows(at, 1);
+}
+
+/* move the gap of row to at, and make it at least need bytes long. */
+void row_gap(erow *row, size_t at, size_t need)
+{
+	if (at < row->gap) memmove(&row->chars[at + row->gaplen], &row->chars[at], row->gap - at);
+	else if (at > row->gap) memmove(&row->chars[row->gap], &row->chars[row->gap + row->gaplen], at - row->gap);
+	row->gap = at;
+	if (row->gaplen >= need) return;
+
+	/* leave room for more than was asked, so typing on doesn't move the rest of the row every time. */
+	size_t gaplen = need + row->size / 8 + 16;
+	row->chars = realloc(row->chars, row->size + gaplen + 1);
+	memmove(&row->chars[at + gaplen], &row->chars[at + row->gaplen], row->size - at + 1);
+	row->gaplen = gaplen;
+}
+
+/* the chars of row in one piece and followed by a '\0', with the gap moved out of the way to the end. */
+char *row_text(erow *row)
+{
+	row_gap(row, row->size, 0);
+	row->chars[row->size] = '\0';
+	return row->chars;
+}
+
+char row_char(erow *row, size_t at)
+{
+	return (at < row->gap) ? row->chars[at] : row->chars[at + row->gaplen];
+}
+
+/* replace the removed chars of row at at with the added ones of s. The gap is moved to at and they go in there,
+ * so a run of edits in the same place only costs as much as the chars it changes.
+ */
+void row_edit(erow *row, size_t at, size_t removed, const char *s, size_t added)
+{
+	/* long rows keep their marks, and just have their window rendered again. */
+	int patch = row->render && row->hl_in != LEX_UNKNOWN && row->size >= KILO_LONG_ROW &&
+		row->size - removed + added >= KILO_LONG_ROW;
+
+	if (removed > 0 && at + removed == row->gap) row->gap = at;
+	else row_gap(row, at, 0);
+	row->gaplen += removed;
+	row->size -= removed;
+
+	row_gap(row, at, added);
+	if (added > 0) memcpy(&row->chars[at], s, added);
+	row->gap += added;
+	row->gaplen -= added;
+	row->size += added;
+
+	tab_map_edit(row, at, removed, added);
+	if (patch) row_patch(row, at, removed, added);
+	else update_row(row);
+	E.dirty++;
+}
+
+void row_insert_char(erow *row, size_t at, int c)
+{
+	if (at > row->size) at = row->size;
+	char ch = c;
+	row_edit(row, at, 0, &ch, 1);
+}
+
+void row_delete_char(erow *row, size_t at)
+{
+	if (at >= row->size) return;
+	row_edit(row, at, 1, NULL, 0);
+}
+
+void row_append_string(erow *row, char *s, size_t len)
+{
+	row_edit(row, row->size, 0, s, len);
+}
+
+void row_insert_string(erow *row, size_t at, const char *s, size_t len)
+{
+	if (at > row->size) at = row->size;
+	row_edit(row, at, 0, s, len);
+}
+
+/*** editor operations ***/
+
+/* give the cursor a row to edit when it is on the line past the end of the file. */
+void insert_last_row(void)
+{
+	if (E.cy != E.numrows) return;
+	/* as far as undo goes, that is a newline at the end of the last row. */
+	if (E.numrows > 0) {
+		size_t len = row_size(E.numrows - 1);
+		undo_push(UNDO_INSERT, E.undo.step, E.numrows - 1, len, E.numrows, 0, "\n", 1);
+	}
+	insert_row(E.numrows, "", 0);
+}
+
+void insert_char(int c)
+{
+	insert_last_row();
+	row_insert_char(row_at(E.cy), E.cx, c);
+	syntax_invalidate(E.cy, 0, 0);
+	char ch = c;
+	undo_push(UNDO_INSERT, E.undo.step, E.cy, E.cx, E.cy, E.cx + 1, &ch, 1);
+	E.cx++;
+}
+
+void delete_char(void)
+{
+	if (E.cy == E.numrows) return;
+	if (E.cx == 0 && E.cy == 0) return;
+
+	erow *row = row_at(E.cy);
+	if (E.cx > 0) {
+		char c = row_char(row, E.cx - 1);
+		undo_push(UNDO_DELETE, E.undo.step, E.cy, E.cx - 1, E.cy, E.cx, &c, 1);
+		row_delete_char(row, E.cx - 1);
+		syntax_invalidate(E.cy, 0, 0);
+		E.cx--;
+	} else {
+		erow *prev = row_at(E.cy - 1);
+		undo_push(UNDO_DELETE, E.undo.step, E.cy - 1, prev->size, E.cy, 0, "\n", 1);
+		E.cx = prev->size;
+		row_append_string(prev, row_text(row), row->size);
+		delete_row(E.cy);
+		E.cy--;
+		syntax_invalidate(E.cy, 0, 0);
+	}
+}
+
+void insert_newline(void)
+{
+	if (E.cy == E.numrows) {
+		insert_last_row();
+		E.cy++;
+		return;
+	}
+	undo_push(UNDO_INSERT, E.undo.step, E.cy, E.cx, E.cy + 1, 0, "\n", 1);
+	if (E.cx == 0) {
+		insert_row(E.cy, "", 0);
+	} else {
+		/* rows live in their own tree nodes, so row stays valid across insert_row. */
+		erow *row = row_at(E.cy);
+		insert_row(E.cy + 1, &row_text(row)[E.cx], row->size - E.cx);
+		row_edit(row, E.cx, row->size - E.cx, NULL, 0);
+		syntax_invalidate(E.cy, 0, 0);
+	}
+
+	E.cy++;
+	E.cx = 0;
+}
+
+/* return where the line of text starting at i ends, and store where the next one starts in next.
+ * Lines may end in "\n", "\r\n" or a lone "\r", which is what terminals send for a pasted newline.
+ */
+size_t text_line_end(const char *s, size_t len, size_t i, size_t *next)
+{
+	while (i < len && s[i] != '\n' && s[i] != '\r') i++;
+	*next = i;
+	if (i < len) {
+		(*next)++;
+		if (s[i] == '\r' && i + 1 < len && s[i + 1] == '\n') (*next)++;
+	}
+	return i;
+}
+
+/* insert a block of text that may span many lines at column col of row at, and store
+ * where it ends in end_row and end_col.
+ * The text is split into lines in a single pass, the row is changed once and
+ * all the new rows are put into the row tree in one go.
+ */
+void text_insert(size_t at, size_t col, const char *s, size_t len, size_t *end_row, size_t *end_col)
+{
+	*end_row = at;
+	*end_col = col;
+	erow *row = row_at(at);
+	if (len == 0 || row == NULL) return;
+
+	size_t next;
+	size_t end = text_line_end(s, len, 0, &next);
+	if (end == len) {
+		row_insert_string(row, col, s, len);
+		syntax_invalidate(at, 0, 0);
+		*end_col = col + len;
+		return;
+	}
+
+	/* whatever followed col goes to the end of the last inserted line. */
+	size_t taillen = row->size - col;
+	char *tail = malloc(taillen + 1);
+	memcpy(tail, &row_text(row)[col], taillen);
+	row_edit(row, col, taillen, s, end);
+	syntax_invalidate(at, 0, 0);
+
+	rnode *t = NULL;
+	size_t start = next;
+	size_t lastlen = 0;
+	while (1) {
+		end = text_line_end(s, len, start, &next);
+		if (end == len) {
+			/* the last line, which also ends the text without a newline. */
+			rnode *node = row_node(&s[start], end - start);
+			row_append_string(&node->row, tail, taillen);
+			t = rope_merge(t, node);
+			lastlen = end - start;
+			break;
+		}
+		t = rope_merge(t, row_node(&s[start], end - start));
+		start = next;
+	}
+	free(tail);
+
+	size_t added = rope_count(t);
+	insert_row_tree(at + 1, t);
+	*end_row = at + added;
+	*end_col = lastlen;
+}
+
+/* delete the text from column col of row at up to column end_col of row end_row.
+ * The rows in between are cut out of the tree in one go, however many there are.
+ */
+void text_delete(size_t at, size_t col, size_t end_row, size_t end_col)
+{
+	if (end_row >= E.numrows || end_row < at) return;
+	erow *row = row_at(at);
+	if (end_row == at) {
+		row_edit(row, col, end_col - col, NULL, 0);
+		syntax_invalidate(at, 0, 0);
+		return;
+	}
+
+	/* join what is left of the first row with whatever follows the text on the last one. */
+	erow *last = row_at(end_row);
+	row_edit(row, col, row->size - col, &row_text(last)[end_col], last->size - end_col);
+	delete_rows(at + 1, end_row - at);
+	syntax_invalidate(at, 0, 0);
+}
+
+/* insert a block of text at the cursor, pasted text for one. */
+void insert_text(const char *s, size_t len)
+{
+	if (len == 0) return;
+	insert_last_row();
+	size_t at = E.cy, col = E.cx;
+	text_insert(at, col, s, len, &E.cy, &E.cx);
+	undo_push(UNDO_INSERT, E.undo.step, at, col, E.cy, E.cx, s, len);
+}
+
+/* ask for a new tab stop, and render every row again with it. */
+void editor_tabstop(void)
+{
+	char *answer = editor_prompt("Tab stop: %s (ESC to cancel)", NULL);
+	if (answer == NULL) return;
+	int tabstop = atoi(answer);
+	free(answer);
+	if (tabstop < 1 || tabstop > KILO_TAB_STOP_MAX) {
+		set_status_msg("Tab stop has to be between 1 and %d", KILO_TAB_STOP_MAX);
+		return;
+	}
+	E.tabstop = tabstop;
+	/* tab maps notice the change themselves when they are next used. */
+	while (E.cache_tail) update_row(E.cache_tail);
+}
+
+/*** undo ***/
+
+/* bytes an op with len bytes of text takes up in the undo log. */
+size_t undo_op_size(size_t len)
+{
+	return sizeof(undo_op) + ((len + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1)) + sizeof(size_t);
+}
+
+/* return the offset of the last op that can be undone. */
+size_t undo_last(void)
+{
+	size_t size;
+	memcpy(&size, &E.undo.buf[E.undo.end - sizeof(size_t)], sizeof(size_t));
+	return E.undo.end - size;
+}
+
+/* make room for size more bytes at the end of the log, moving the history to the front of the
+ * arena before growing it. The caller has checked that the history stays within its limit.
+ */
+void undo_reserve(size_t size)
+{
+	undo_log *u = &E.undo;
+	if (u->end + size <= u->cap) return;
+	/* there is no history to move before the first edit. */
+	if (u->end > u->start) memmove(u->buf, &u->buf[u->start], u->end - u->start);
+	u->end -= u->start;
+	u->top -= u->start;
+	u->start = 0;
+	if (u->end + size > u->cap) {
+		u->cap = (u->end + size) * 2;
+		if (u->cap > u->limit) u->cap = u->limit;
+		u->buf = realloc(u->buf, u->cap);
+		if (u->buf == NULL) die("realloc");
+	}
+}
+
+/* Add a single typed or deleted character to the last op if it carries on from where that
+ * left off in the same step, so typing a word or deleting one is undone in one go. Returns 1 if it did.
+ */
+int undo_coalesce(int type, unsigned long step, size_t row, size_t col, size_t end_row, size_t end_col, const char *text, size_t len)
+{
+	undo_log *u = &E.undo;
+	if (len != 1 || text[0] == '\n' || end_row != row || u->end == u->start) return 0;
+
+	size_t off = undo_last();
+	undo_op *op = (undo_op *) &u->buf[off];
+	if (op->step != step || op->type != type || op->row != row || op->end_row != row) return 0;
+
+	int prepend;
+	if (type == UNDO_INSERT && op->end_col == col) {
+		/* typing on. */
+		prepend = 0;
+	} else if (type == UNDO_DELETE && op->col == end_col) {
+		/* backspace. */
+		prepend = 1;
+	} else if (type == UNDO_DELETE && op->col == col) {
+		/* delete. */
+		prepend = 0;
+	} else {
+		return 0;
+	}
+
+	/* the op may need another word for its text, leave it to undo_push() to trim the history for that. */
+	size_t size = undo_op_size(op->len + 1);
+	size_t grow = size - undo_op_size(op->len);
+	if (u->end - u->start + grow > u->limit) return 0;
+	if (grow) {
+		size_t back = u->end - off;
+		undo_reserve(grow);
+		off = u->end - back;
+		op = (undo_op *) &u->buf[off];
+	}
+
+	if (prepend) op->col = col;
+	else if (type == UNDO_INSERT) op->end_col = end_col;
+	else op->end_col++;
+	char *t = (char *) (op + 1);
+	if (prepend) {
+		memmove(t + 1, t, op->len);
+		t[0] = text[0];
+	} else {
+		t[op->len] = text[0];
+	}
+	op->len++;
+	memcpy(&u->buf[off + size - sizeof(size_t)], &size, sizeof(size_t));
+	u->end = u->top = off + size;
+	return 1;
+}
+
+/* forget all history because the ops of step can't all be kept, and log none of the rest of them. */
+void undo_truncate(unsigned long step)
+{
+	undo_log *u = &E.undo;
+	u->start = u->end = u->top = 0;
+	u->truncated = 1;
+	u->lost_step = step;
+}
+
+/* log an edit. Anything that was undone can't be redone after it, and the oldest steps are
+ * dropped whole to keep the log within its limit, so no step is ever undone only in part.
+ */
+void undo_push(int type, unsigned long step, size_t row, size_t col, size_t end_row, size_t end_col, const char *text, size_t len)
+{
+	undo_log *u = &E.undo;
+	journal_add(type, row, col, end_row, end_col, text, len);
+	if (u->replaying) return;
+	u->top = u->end;
+	if (u->truncated && step == u->lost_step) return;
+	if (undo_coalesce(type, step, row, col, end_row, end_col, text, len)) return;
+
+	size_t size = undo_op_size(len);
+	if (size > u->limit) {
+		undo_truncate(step);
+		return;
+	}
+	while (u->end - u->start + size > u->limit) {
+		/* drop the oldest step, unless it is this one and the step can't fit by itself. */
+		unsigned long oldest = ((undo_op *) &u->buf[u->start])->step;
+		if (oldest == step) {
+			undo_truncate(step);
+			return;
+		}
+		while (u->start < u->end) {
+			undo_op *old = (undo_op *) &u->buf[u->start];
+			if (old->step != oldest) break;
+			u->start += undo_op_size(old->len);
+		}
+		u->truncated = 1;
+	}
+	undo_reserve(size);
+
+	undo_op *op = (undo_op *) &u->buf[u->end];
+	op->type = type;
+	op->step = step;
+	op->row = row;
+	op->col = col;
+	op->end_row = end_row;
+	op->end_col = end_col;
+	op->len = len;
+	memcpy(op + 1, text, len);
+	memcpy(&u->buf[u->end + size - sizeof(size_t)], &size, sizeof(size_t));
+	u->end = u->top = u->end + size;
+}
+
+/* undo an op, or do it again if undo is 0, and put the cursor where it happened. */
+void undo_apply(undo_op *op, int undo)
+{
+	char *text = (char *) (op + 1);
+	if ((op->type == UNDO_INSERT) == undo) {
+		journal_add(UNDO_DELETE, op->row, op->col, op->end_row, op->end_col, text, op->len);
+		text_delete(op->row, op->col, op->end_row, op->end_col);
+		E.cy = op->row;
+		E.cx = op->col;
+	} else {
+		journal_add(UNDO_INSERT, op->row, op->col, op->end_row, op->end_col, text, op->len);
+		text_insert(op->row, op->col, text, op->len, &E.cy, &E.cx);
+	}
+}
+
+void editor_undo(void)
+{
+	undo_log *u = &E.undo;
+	if (replace_busy()) return;
+	if (u->end == u->start) {
+		if (u->truncated) set_status_msg("Nothing more to undo, older history was dropped to stay within its limit");
+		else set_status_msg("Nothing to undo");
+		return;
+	}
+
+	/* undo the last command, which may have made many ops. */
+	unsigned long step = ((undo_op *) &u->buf[undo_last()])->step;
+	u->replaying = 1;
+	while (u->end > u->start) {
+		size_t off = undo_last();
+		undo_op *op = (undo_op *) &u->buf[off];
+		if (op->step != step) break;
+		undo_apply(op, 1);
+		u->end = off;
+	}
+	u->replaying = 0;
+}
+
+void editor_redo(void)
+{
+	undo_log *u = &E.undo;
+	if (replace_busy()) return;
+	if (u->end == u->top) {
+		set_status_msg("Nothing to redo");
+		return;
+	}
+
+	unsigned long step = ((undo_op *) &u->buf[u->end])->step;
+	u->replaying = 1;
+	while (u->end < u->top) {
+		undo_op *op = (undo_op *) &u->buf[u->end];
+		if (op->step != step) break;
+		undo_apply(op, 0);
+		u->end += undo_op_size(op->len);
+	}
+	u->replaying = 0;
+}
+
+/*** line index ***/
+/* Find where every line of a mapped file starts.
+ * A line starts at offset 0 and after every '\n' that is not the last byte of the file,
+ * so "\r\n" endings split the same way and their '\r' is trimmed later by line_text().
+ */
+
+void index_push(line_index *idx, size_t off)
+{
+	if (idx->nlines == idx->cap) {
+		idx->cap = idx->cap ? idx->cap * 2 : 1024;
+		idx->lines = realloc(idx->lines, sizeof(size_t) * idx->cap);
+	}
+	idx->lines[idx->nlines++] = off;
+}
+
+/* record the line started by every newline in the chunk from byte i on, using memchr. */
+void scan_newlines_memchr(line_index *idx, size_t i)
+{
+	const char *p = idx->buf + idx->start + i;
+	const char *end = idx->buf + idx->start + idx->len;
+	while ((p = memchr(p, '\n', end - p)) != NULL) {
+		p++;
+		if ((size_t) (p - idx->buf) < idx->filesize) index_push(idx, p - idx->buf);
+	}
+}
+
+#ifdef KILO_X86
+#ifdef __SSE2__
+void scan_newlines_sse2(line_index *idx, size_t i)
+{
+	const char *base = idx->buf + idx->start;
+	const __m128i nl = _mm_set1_epi8('\n');
+	for (; i + 16 <= idx->len; i += 16) {
+		/* compare 16 bytes at once and get one bit per newline. */
+		__m128i v = _mm_loadu_si128((const __m128i *) (base + i));
+		unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+		while (mask) {
+			size_t off = idx->start + i + __builtin_ctz(mask) + 1;
+			if (off < idx->filesize) index_push(idx, off);
+			mask &= mask - 1;
+		}
+	}
+	scan_newlines_memchr(idx, i);
+}
+#endif
+
+__attribute__((target("avx2")))
+void scan_newlines_avx2(line_index *idx, size_t i)
+{
+	const char *base = idx->buf + idx->start;
+	const __m256i nl = _mm256_set1_epi8('\n');
+	for (; i + 64 <= idx->len; i += 64) {
+		/* two 32 byte compares per step, most 64 byte blocks have at most one newline. */
+		__m256i a = _mm256_loadu_si256((const __m256i *) (base + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *) (base + i + 32));
+		unsigned long long mask = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, nl));
+		mask |= (unsigned long long) (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(b, nl)) << 32;
+		while (mask) {
+			size_t off = idx->start + i + __builtin_ctzll(mask) + 1;
+			if (off < idx->filesize) index_push(idx, off);
+			mask &= mask - 1;
+		}
+	}
+	scan_newlines_memchr(idx, i);
+}
+#endif
+
+/* pick the widest scanner the CPU supports. */
+void scan_newlines(line_index *idx)
+{
+#ifdef KILO_X86
+	if (__builtin_cpu_supports("avx2")) {
+		scan_newlines_avx2(idx, 0);
+		return;
+	}
+#ifdef __SSE2__
+	scan_newlines_sse2(idx, 0);
+	return;
+#endif
+#endif
+	scan_newlines_memchr(idx, 0);
+}
+
+void *index_thread(void *arg)
+{
+	scan_newlines(arg);
+	return NULL;
+}
+
+/* return the offsets of the starts of all lines in buf, and store their count in nlines.
+ * Large files are cut into chunks that are scanned on their own threads, the chunks'
+ * line starts are then concatenated in order.
+ */
+size_t *build_line_index(const char *buf, size_t len, size_t *nlines)
+{
+	int nthreads = 1;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	while (nthreads < KILO_INDEX_THREADS && nthreads < ncpu && len / (nthreads + 1) >= KILO_INDEX_CHUNK)
+		nthreads++;
+	return index_lines(buf, len, nthreads, nlines);
+}
+
+/* build_line_index() on exactly nthreads threads, at most KILO_INDEX_THREADS of them. */
+size_t *index_lines(const char *buf, size_t len, int nthreads, size_t *nlines)
+{
+	line_index idx[KILO_INDEX_THREADS];
+	pthread_t threads[KILO_INDEX_THREADS];
+	size_t chunk = len / nthreads;
+	int t;
+	for (t = 0; t < nthreads; t++) {
+		idx[t].buf = buf;
+		idx[t].start = t * chunk;
+		idx[t].len = (t == nthreads - 1) ? len - idx[t].start : chunk;
+		idx[t].filesize = len;
+		idx[t].lines = NULL;
+		idx[t].nlines = 0;
+		idx[t].cap = 0;
+	}
+
+	/* the first chunk is scanned on this thread. */
+	for (t = 1; t < nthreads; t++) {
+		if (pthread_create(&threads[t], NULL, index_thread, &idx[t]) != 0) die("pthread_create");
+	}
+	scan_newlines(&idx[0]);
+
+	size_t total = 1;
+	for (t = 0; t < nthreads; t++) {
+		if (t > 0) pthread_join(threads[t], NULL);
+		total += idx[t].nlines;
+	}
+
+	size_t *lines = malloc(sizeof(size_t) * total);
+	lines[0] = 0;
+	size_t n = 1;
+	for (t = 0; t < nthreads; t++) {
+		if (idx[t].nlines) memcpy(&lines[n], idx[t].lines, sizeof(size_t) * idx[t].nlines);
+		n += idx[t].nlines;
+		free(idx[t].lines);
+	}
+
+	*nlines = n;
+	return lines;
+}
+
+/*** file IO ***/
+
+void editor_open(char *filename)
+{
+	free(E.filename);
+	E.filename = strdup(filename);
+	select_syntax();
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1) die("open");
+
+	struct stat st;
+	if (fstat(fd, &st) == -1) die("fstat");
+	E.mapsize = st.st_size;
+	if (E.mapsize == 0) {
+		close(fd);
+		return;
+	}
+
+	/* map the file instead of reading it, rows are only copied out of it when they are needed. */
+	E.map = mmap(NULL, E.mapsize, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (E.map == MAP_FAILED) die("mmap");
+
+	/* index where every line starts, that is the only work done up front. */
+	E.lines = build_line_index(E.map, E.mapsize, &E.nlines);
+
+	/* the whole file starts out as a single unloaded span. */
+	E.rows = rope_node();
+	E.rows->span = E.nlines;
+	rope_update(E.rows);
+	E.numrows = E.nlines;
+	E.dirty = 0;
+}
+
+/* write all of iov to fd, picking up after short writes. return 0, or -1 on an error. */
+int write_iov(int fd, struct iovec *iov, int n)
+{
+	while (n > 0) {
+		ssize_t written = writev(fd, iov, n);
+		if (written == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		while (n > 0 && (size_t) written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n > 0) {
+			iov->iov_base = (char *) iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+	return 0;
+}
+
+/* add len bytes at s to the batch of n pieces in iov, writing the batch out when it is full.
+ * A piece that starts right where the last one ends just makes it longer.
+ */
+void iov_add(int fd, struct iovec *iov, int *n, const char *s, size_t len, int *err)
+{
+	if (len == 0 || *err) return;
+	if (*n > 0 && (char *) iov[*n - 1].iov_base + iov[*n - 1].iov_len == s) {
+		iov[*n - 1].iov_len += len;
+		return;
+	}
+	if (*n == KILO_SAVE_IOV) {
+		if (write_iov(fd, iov, *n) == -1) *err = 1;
+		*n = 0;
+	}
+	iov[*n].iov_base = (char *) s;
+	iov[*n].iov_len = len;
+	(*n)++;
+}
+
+/* write the rows to fd straight from where they are kept, without copying the file.
+ * return the number of bytes written, or -1 on an error.
+ */
+ssize_t rows_write(int fd, save_state *state)
+{
+	struct iovec iov[KILO_SAVE_IOV];
+	int n = 0, err = 0;
+	size_t total = 0;
+	struct timespec last;
+	clock_gettime(CLOCK_MONOTONIC, &last);
+	size_t j;
+	for (j = 0; j < E.numrows && !err; j++) {
+		if ((j & 0xffff) == 0) {
+			state->rows = j;
+			if (elapsed_ms(&last) >= KILO_PROGRESS_MS) editor_wake();
+		}
+
+		/* an edited row goes out as the chars before its gap and those after it, the gap isn't closed for it. */
+		lex_text t;
+		row_read(j, &t);
+		/* rows still in the mapped file can use their own newline, so a whole span of them goes out as one piece. */
+		const char *newline = "\n";
+		if (E.map && t.s >= E.map && t.s + t.len < E.map + E.mapsize && t.s[t.len] == '\n') newline = &t.s[t.len];
+		iov_add(fd, iov, &n, t.s, t.gap, &err);
+		iov_add(fd, iov, &n, &t.s[t.gap + t.gaplen], t.len - t.gap, &err);
+		iov_add(fd, iov, &n, newline, 1, &err);
+		total += t.len + 1;
+	}
+	if (err || write_iov(fd, iov, n) == -1) return -1;
+	return total;
+}
+
+/* return the directory path is in. */
+char *dir_of(const char *path)
+{
+	char *dir = malloc(strlen(path) + 2);
+	strcpy(dir, path);
+	char *slash = strrchr(dir, '/');
+	if (slash == dir) slash[1] = '\0';
+	else if (slash) *slash = '\0';
+	else strcpy(dir, ".");
+	return dir;
+}
+
+/* make a rename into directory dir survive a crash. */
+void fsync_dir(const char *dir)
+{
+	int fd = open(dir, O_RDONLY);
+	if (fd != -1) {
+		fsync(fd);
+		close(fd);
+	}
+}
+
+/* Write the rows to the temporary file named by the mkstemp() template tmp, and rename
+ * it over the file once it is all on disk, so a crash halfway through leaves the old
+ * file as it was. The mapping of the old file stays valid after the rename.
+ * This runs in the child process of a save, so it doesn't allocate: the editor's other
+ * threads are gone in the child and may have left the allocator locked.
+ */
+ssize_t save_write(char *tmp, const char *dir, save_state *state)
+{
+	int fd = mkstemp(tmp);
+	if (fd == -1) return -1;
+
+	/* mkstemp() makes the file private, give it the permissions of the file it replaces instead. */
+	struct stat st;
+	mode_t mask = umask(0);
+	umask(mask);
+	fchmod(fd, stat(E.filename, &st) == 0 ? st.st_mode & 07777 : 0644 & ~mask);
+
+	ssize_t len = rows_write(fd, state);
+	if (len != -1 && fsync(fd) == 0) {
+		close(fd);
+		if (rename(tmp, E.filename) == 0) {
+			fsync_dir(dir);
+			return len;
+		}
+		fd = -1;
+	}
+
+	int err = errno;
+	if (fd != -1) close(fd);
+	unlink(tmp);
+	errno = err;
+	return -1;
+}
+
+/* Save in the background. Rather than a thread working on a copy-on-write snapshot of the
+ * rows, which the rope, the gap buffers and the row cache would all have to learn to share,
+ * the snapshot is a fork(): the child sees the rows as they were and writes them out while
+ * the editor goes on. What that costs:
+ *  - fork() copies the page tables, about 2MB for every GB mapped or allocated, so on a file
+ *    of many GB the key that saves takes some milliseconds longer.
+ *  - every page the editor writes to while the child runs is copied once, so memory can grow
+ *    by as much as is edited during the save.
+ *  - only the thread that forks is in the child. The workers may have left the allocator or
+ *    stdio locked, so the child must not malloc(), printf() or take E.lock. It only runs
+ *    save_write() and rows_write(), which walk the rope and the mapped file and otherwise
+ *    stick to system calls, then editor_wake() and _exit(). Everything that allocates is
+ *    done before the fork.
+ */
+void editor_save(void)
+{
+	if (E.filename == NULL) {
+		E.filename = editor_prompt("Save as: %s", NULL);
+		if (E.filename == NULL) {
+			set_status_msg("Save aborted");
+			return;
+		}
+		select_syntax();
+	}
+	if (E.save.pid) {
+		set_status_msg("Still saving, try again when it is done");
+		return;
+	}
+
+	size_t namelen = strlen(E.filename);
+	char *tmp = malloc(namelen + 8);
+	snprintf(tmp, namelen + 8, "%s.XXXXXX", E.filename);
+	char *dir = dir_of(E.filename);
+	save_state *state = mmap(NULL, sizeof(save_state), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (state == MAP_FAILED) die("mmap");
+	state->rows = 0;
+	state->done = 0;
+
+	/* the child writes the file from its snapshot of the rows and wakes us up when it is done. */
+	pid_t pid = fork();
+	if (pid == 0) {
+		state->bytes = save_write(tmp, dir, state);
+		state->err = errno;
+		state->done = 1;
+		editor_wake();
+		_exit(0);
+	}
+	free(tmp);
+	free(dir);
+	if (pid == -1) {
+		munmap(state, sizeof(save_state));
+		set_status_msg("Can't save! %s", strerror(errno));
+		return;
+	}
+
+	E.save.pid = pid;
+	E.save.dirty = E.dirty;
+	E.save.numrows = E.numrows;
+	E.save.shown = -1;
+	E.save.state = state;
+	journal_save_start();
+	save_poll();
+}
+
+/*** journal ***/
+
+/* return the name of the journal of file, a hidden file next to it. */
+char *journal_name(const char *file)
+{
+	const char *base = strrchr(file, '/');
+	base = base ? base + 1 : file;
+	size_t size = strlen(file) + 16;
+	char *name = malloc(size);
+	snprintf(name, size, "%.*s.%s.journal", (int) (base - file), file, base);
+	return name;
+}
+
+/* create a journal at path for the file as it is on disk now, return its fd or -1. */
+int journal_create(const char *path)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+	if (fd == -1) return -1;
+	journal_head head;
+	memset(&head, 0, sizeof(head));
+	memcpy(head.magic, KILO_JOURNAL_MAGIC, sizeof(head.magic));
+	struct stat st;
+	if (stat(E.filename, &st) == 0) {
+		head.size = st.st_size;
+		head.mtime = st.st_mtim;
+	}
+	journal_write(fd, (char *) &head, sizeof(head));
+	return fd;
+}
+
+/* queue an edit to be written to the journal. Only the main thread waits for the journal
+ * thread to be done with buf, it never waits for the disk.
+ */
+void journal_add(int type, size_t row, size_t col, size_t end_row, size_t end_col, const char *text, size_t len)
+{
+	journal *j = &E.journal;
+	if (j->replaying || (j->fd == -1 && j->next_fd == -1)) return;
+
+	if (j->len + sizeof(undo_op) + len > j->cap) {
+		j->cap = (j->len + sizeof(undo_op) + len) * 2;
+		j->buf = realloc(j->buf, j->cap);
+	}
+	undo_op op;
+	memset(&op, 0, sizeof(op));
+	op.type = type;
+	op.row = row;
+	op.col = col;
+	op.end_row = end_row;
+	op.end_col = end_col;
+	op.len = len;
+	memcpy(&j->buf[j->len], &op, sizeof(op));
+	memcpy(&j->buf[j->len + sizeof(op)], text, len);
+	j->len += sizeof(op) + len;
+	/* wake the thread to start the timer, and again once there are enough edits to write right away. */
+	if (++j->ops == 1 || j->ops == KILO_JOURNAL_OPS) pthread_cond_signal(&j->cond);
+}
+
+void journal_write(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			return;
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+/* write the edits in the journal a batch at a time, so typing never waits for fsync(). */
+void *journal_thread(void *arg)
+{
+	(void) arg;
+	journal *j = &E.journal;
+	char *spare = NULL;
+	size_t spare_cap = 0;
+
+	pthread_mutex_lock(&E.lock);
+	while (1) {
+		while (j->len == 0 && j->rotate == 0) pthread_cond_wait(&j->cond, &E.lock);
+		if (j->ops < KILO_JOURNAL_OPS && j->rotate == 0) {
+			/* give the edits coming after this one the chance to go to disk with it. */
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += KILO_JOURNAL_MS * 1000000L;
+			deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+			deadline.tv_nsec %= 1000000000L;
+			while (j->ops < KILO_JOURNAL_OPS && j->rotate == 0 &&
+					pthread_cond_timedwait(&j->cond, &E.lock, &deadline) == 0);
+		}
+
+		/* take the edits and hand the main thread an empty buffer to go on with. */
+		char *buf = j->buf;
+		size_t cap = j->cap, len = j->len, split = j->split;
+		j->buf = spare;
+		j->cap = spare_cap;
+		j->len = 0;
+		j->split = 0;
+		j->ops = 0;
+		int fd = j->fd, next_fd = j->next_fd, rotate = j->rotate;
+		char *path = j->path, *next_path = j->next_path;
+		if (rotate) {
+			if (rotate == 1) j->fd = next_fd;
+			j->next_fd = -1;
+			j->next_path = NULL;
+			j->rotate = 0;
+		}
+		pthread_mutex_unlock(&E.lock);
+
+		if (fd != -1) journal_write(fd, buf, len);
+		if (next_fd != -1) journal_write(next_fd, &buf[split], len - split);
+		if (rotate == 1) {
+			fsync(next_fd);
+			rename(next_path, path);
+			char *dir = dir_of(path);
+			fsync_dir(dir);
+			free(dir);
+			if (fd != -1) close(fd);
+		} else {
+			if (rotate == -1) {
+				close(next_fd);
+				unlink(next_path);
+			}
+			if (fd != -1) fdatasync(fd);
+		}
+		if (rotate) free(next_path);
+
+		pthread_mutex_lock(&E.lock);
+		spare = buf;
+		spare_cap = cap;
+	}
+	return NULL;
+}
+
+/* a save took its snapshot, start the journal for the file it is writing. */
+void journal_save_start(void)
+{
+	journal *j = &E.journal;
+	/* let the journal thread hand over to the journal of the last save first. */
+	while (j->rotate) {
+		editor_unlock();
+		sched_yield();
+		editor_lock();
+	}
+	if (j->path == NULL) j->path = journal_name(E.filename);
+	size_t size = strlen(j->path) + 8;
+	char *next = malloc(size);
+	snprintf(next, size, "%s.XXXXXX", j->path);
+	int fd = mkstemp(next);
+	if (fd == -1) {
+		free(next);
+		return;
+	}
+	/* the head is filled in once the file has been written. */
+	journal_head head;
+	memset(&head, 0, sizeof(head));
+	journal_write(fd, (char *) &head, sizeof(head));
+	j->next_fd = fd;
+	j->next_path = next;
+	j->split = j->len;
+}
+
+/* the save is over, hand over to its journal if it worked. */
+void journal_save_done(int ok)
+{
+	journal *j = &E.journal;
+	if (j->next_fd == -1) return;
+	if (ok) {
+		journal_head head;
+		memset(&head, 0, sizeof(head));
+		memcpy(head.magic, KILO_JOURNAL_MAGIC, sizeof(head.magic));
+		struct stat st;
+		if (stat(E.filename, &st) == 0) {
+			head.size = st.st_size;
+			head.mtime = st.st_mtim;
+		}
+		pwrite(j->next_fd, &head, sizeof(head), 0);
+	}
+	j->rotate = ok ? 1 : -1;
+	pthread_cond_signal(&j->cond);
+}
+
+/* Make the edits in the len bytes of journal data again and return how many bytes of it held
+ * whole edits. Characters typed one after another are put in as a single insert.
+ */
+size_t journal_replay(const char *data, size_t len)
+{
+	char *batch = NULL;
+	size_t blen = 0, bcap = 0;
+	size_t brow = 0, bcol = 0, bend = 0;	/* where the batch goes, and the column it has got to. */
+	size_t end_row, end_col;
+
+	size_t off = sizeof(journal_head);
+	while (1) {
+		undo_op op;
+		int whole = (off + sizeof(op) <= len);
+		if (whole) {
+			memcpy(&op, &data[off], sizeof(op));
+			whole = (op.len <= len - off - sizeof(op));
+		}
+		const char *text = whole ? &data[off + sizeof(op)] : NULL;
+
+		/* add typing to the batch as long as it carries on from where the batch ends. */
+		if (whole && op.type == UNDO_INSERT && op.row == op.end_row && blen > 0 && op.row == brow && op.col == bend) {
+			if (blen + op.len > bcap) {
+				bcap = (blen + op.len) * 2;
+				batch = realloc(batch, bcap);
+			}
+			memcpy(&batch[blen], text, op.len);
+			blen += op.len;
+			bend += op.len;
+			off += sizeof(op) + op.len;
+			continue;
+		}
+		if (blen > 0) {
+			text_insert(brow, bcol, batch, blen, &end_row, &end_col);
+			blen = 0;
+		}
+		if (!whole) break;
+
+		/* the edit may have been the first one made on the line past the end of the file. */
+		if (op.type == UNDO_INSERT && op.row == E.numrows) insert_row(E.numrows, "", 0);
+		if (op.type == UNDO_INSERT && op.row == op.end_row && op.len > 0) {
+			/* start a new batch. */
+			if (op.len > bcap) {
+				bcap = op.len * 2;
+				batch = realloc(batch, bcap);
+			}
+			memcpy(batch, text, op.len);
+			blen = op.len;
+			brow = op.row;
+			bcol = op.col;
+			bend = op.col + op.len;
+		} else if (op.type == UNDO_INSERT) {
+			text_insert(op.row, op.col, text, op.len, &end_row, &end_col);
+		} else {
+			text_delete(op.row, op.col, op.end_row, op.end_col);
+		}
+		off += sizeof(op) + op.len;
+	}
+	free(batch);
+	return off;
+}
+
+/* look for the journal of a session that didn't end well, offer to replay it, and start journaling. */
+void journal_start(void)
+{
+	journal *j = &E.journal;
+	if (E.filename == NULL) return;
+	j->path = journal_name(E.filename);
+
+	int fd = open(j->path, O_RDWR);
+	struct stat st, fst;
+	if (fd != -1 && fstat(fd, &st) == 0 && (size_t) st.st_size > sizeof(journal_head)) {
+		char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) die("mmap");
+		journal_head head;
+		memcpy(&head, data, sizeof(head));
+		int matches = memcmp(head.magic, KILO_JOURNAL_MAGIC, sizeof(head.magic)) == 0 &&
+			stat(E.filename, &fst) == 0 && fst.st_size == head.size &&
+			fst.st_mtim.tv_sec == head.mtime.tv_sec && fst.st_mtim.tv_nsec == head.mtime.tv_nsec;
+		if (!matches) {
+			set_status_msg("Found a journal for another version of this file, ignoring it");
+		} else {
+			char *answer = editor_prompt("Found unsaved edits from a session that didn't end well. Replay them? (y/n) %s", NULL);
+			if (answer && (answer[0] == 'y' || answer[0] == 'Y')) {
+				j->replaying = 1;
+				size_t good = journal_replay(data, st.st_size);
+				j->replaying = 0;
+				E.cy = E.cx = 0;
+				munmap(data, st.st_size);
+				/* carry on with this journal, cutting off an edit that was only half written. */
+				if (ftruncate(fd, good) == 0 && lseek(fd, 0, SEEK_END) != -1) {
+					j->fd = fd;
+					set_status_msg("Replayed %zu bytes of unsaved edits", good - sizeof(journal_head));
+					free(answer);
+					return;
+				}
+				data = NULL;
+			}
+			free(answer);
+		}
+		if (data) munmap(data, st.st_size);
+	}
+	if (fd != -1) close(fd);
+	j->fd = journal_create(j->path);
+}
+
+/* the editor is quitting on purpose, so the journal isn't needed any more. */
+void journal_remove(void)
+{
+	journal *j = &E.journal;
+	if (j->path && (j->fd != -1 || j->next_fd != -1)) unlink(j->path);
+	if (j->next_path) unlink(j->next_path);
+}
+
+/* show how a save in the background is getting on, and clean up after it once it is done. */
+void save_poll(void)
+{
+	save_job *job = &E.save;
+	int status = 0;
+	/* the child wakes us up before it exits, so once it is done it is worth waiting for. */
+	if (waitpid(job->pid, &status, job->state->done ? 0 : WNOHANG) == 0) {
+		int percent = job->numrows ? (int) (job->state->rows * 100 / job->numrows) : 0;
+		if (percent != job->shown) set_status_msg("Saving... %d%%", percent);
+		job->shown = percent;
+		return;
+	}
+
+	if (WIFEXITED(status) && job->state->bytes != -1) {
+		/* only the edits made before the snapshot are on disk now. */
+		E.dirty -= job->dirty;
+		set_status_msg("%zd bytes written to disk", job->state->bytes);
+		journal_save_done(1);
+	} else {
+		set_status_msg("Can't save! I/O error: %s", WIFEXITED(status) ? strerror(job->state->err) : "save was killed");
+		journal_save_done(0);
+	}
+	munmap(job->state, sizeof(save_state));
+	job->state = NULL;
+	job->pid = 0;
+}
+
+/* wait for a save in the background to finish. */
+void save_wait(void)
+{
+	if (E.save.pid) waitpid(E.save.pid, NULL, 0);
+}
+
+/*** regex ***/
+/* Regexes are parsed into a syntax tree and compiled to an NFA, which is run as a DFA
+ * built lazily, a state at a time as the text needs it. The states are thrown away when
+ * there get to be too many of them, so a search takes time linear in the length of the
+ * text whatever the pattern, and nothing ever backtracks.
+ * To find the leftmost match, the reversed NFA is run backwards over the whole text to
+ * mark every offset a match starts at. The forward NFA then runs from the first of them
+ * to find where the longest match ends.
+ * Supported are literals, ., [classes], \d \w \s and their negations, * + ? {n,m},
+ * | and (groups), and the ^ and $ anchors.
+ */
+
+int regex_node_new(regex *re, int type, int a, int b)
+{
+	if (re->nnodes == re->cap) {
+		re->cap = re->cap ? re->cap * 2 : 64;
+		re->nodes = realloc(re->nodes, sizeof(regex_node) * re->cap);
+	}
+	regex_node *node = &re->nodes[re->nnodes];
+	node->type = type;
+	node->a = a;
+	node->b = b;
+	node->min = 0;
+	node->max = 0;
+	return re->nnodes++;
+}
+
+/* add a class of bytes to re, returning a node that matches any one of them. */
+int regex_class_node(regex *re, const unsigned char *set)
+{
+	if (re->nclasses == re->ccap) {
+		re->ccap = re->ccap ? re->ccap * 2 : 16;
+		re->classes = realloc(re->classes, 32 * re->ccap);
+	}
+	memcpy(re->classes[re->nclasses], set, 32);
+	return regex_node_new(re, RE_CLASS, re->nclasses++, 0);
+}
+
+void regex_class_add(unsigned char *set, int lo, int hi)
+{
+	int c;
+	for (c = lo; c <= hi; c++) set[c >> 3] |= 1 << (c & 7);
+}
+
+/* add the bytes of a \d, \w or \s escape to set, or all the others for \D, \W or \S. return 0 for any other escape. */
+int regex_class_escape(unsigned char *set, int c)
+{
+	unsigned char bytes[32] = {0};
+	switch (tolower(c)) {
+		case 'd':
+			regex_class_add(bytes, '0', '9');
+			break;
+		case 'w':
+			regex_class_add(bytes, '0', '9');
+			regex_class_add(bytes, 'a', 'z');
+			regex_class_add(bytes, 'A', 'Z');
+			regex_class_add(bytes, '_', '_');
+			break;
+		case 's':
+			regex_class_add(bytes, ' ', ' ');
+			regex_class_add(bytes, '\t', '\r');
+			break;
+		default:
+			return 0;
+	}
+	int i;
+	for (i = 0; i < 32; i++) set[i] |= isupper(c) ? ~bytes[i] : bytes[i];
+	return 1;
+}
+
+/* the byte any other escaped character stands for. */
+int regex_escape_char(int c)
+{
+	if (c == 'n') return '\n';
+	if (c == 't') return '\t';
+	return c;
+}
+
+/* parse a class, *p is just after the [. */
+int regex_parse_class(regex *re, const char **p)
+{
+	unsigned char set[32] = {0};
+	const char *s = *p;
+	int negate = 0;
+	if (*s == '^') {
+		negate = 1;
+		s++;
+	}
+	/* a ] right at the start is part of the class. */
+	int first = 1;
+	while (*s && (*s != ']' || first)) {
+		first = 0;
+		int lo = (unsigned char) *s++;
+		if (lo == '\\' && *s) {
+			if (regex_class_escape(set, (unsigned char) *s)) {
+				s++;
+				continue;
+			}
+			lo = regex_escape_char((unsigned char) *s++);
+		}
+		int hi = lo;
+		if (s[0] == '-' && s[1] && s[1] != ']') {
+			hi = (unsigned char) s[1];
+			s += 2;
+			if (hi == '\\' && *s) hi = regex_escape_char((unsigned char) *s++);
+			if (hi < lo) {
+				re->error = "bad range";
+				return -1;
+			}
+		}
+		regex_class_add(set, lo, hi);
+	}
+	if (*s != ']') {
+		re->error = "missing ]";
+		return -1;
+	}
+	*p = s + 1;
+
+	int i;
+	if (negate)
+		for (i = 0; i < 32; i++) set[i] = ~set[i];
+	return regex_class_node(re, set);
+}
+
+int regex_parse_atom(regex *re, const char **p)
+{
+	unsigned char set[32] = {0};
+	int c = (unsigned char) *(*p)++;
+	int node;
+
+	switch (c) {
+		case '(':
+			node = regex_parse_alt(re, p);
+			if (node == -1) return -1;
+			if (**p != ')') {
+				re->error = "missing )";
+				return -1;
+			}
+			(*p)++;
+			return node;
+		case '[':
+			return regex_parse_class(re, p);
+		case '^':
+			return regex_node_new(re, RE_BEGIN, 0, 0);
+		case '$':
+			return regex_node_new(re, RE_END, 0, 0);
+		case '*':
+		case '+':
+		case '?':
+			re->error = "nothing to repeat";
+			return -1;
+		case '.':
+			memset(set, 0xff, sizeof(set));
+			break;
+		case '\\':
+			if (**p == '\0') {
+				re->error = "trailing \\";
+				return -1;
+			}
+			c = (unsigned char) *(*p)++;
+			if (!regex_class_escape(set, c)) regex_class_add(set, regex_escape_char(c), regex_escape_char(c));
+			break;
+		default:
+			regex_class_add(set, c, c);
+	}
+	return regex_class_node(re, set);
+}
+
+/* parse a {n}, {n,} or {n,m} bound, *p is at the {. return 0 if it isn't one, so the { is taken literally. */
+int regex_parse_bound(regex *re, const char **p, int *min, int *max)
+{
+	const char *s = *p + 1;
+	if (!isdigit((unsigned char) *s)) return 0;
+	*min = 0;
+	while (isdigit((unsigned char) *s) && *min <= KILO_REGEX_REPEAT) *min = *min * 10 + *s++ - '0';
+	*max = *min;
+	if (*s == ',') {
+		s++;
+		*max = -1;
+		if (isdigit((unsigned char) *s)) {
+			*max = 0;
+			while (isdigit((unsigned char) *s) && *max <= KILO_REGEX_REPEAT) *max = *max * 10 + *s++ - '0';
+		}
+	}
+	if (*s != '}') return 0;
+	if (*min > KILO_REGEX_REPEAT || *max > KILO_REGEX_REPEAT || (*max != -1 && *max < *min)) {
+		re->error = "bad {bound}";
+		return 0;
+	}
+	*p = s + 1;
+	return 1;
+}
+
+int regex_parse_repeat(regex *re, const char **p)
+{
+	int node = regex_parse_atom(re, p);
+	while (node != -1) {
+		int min, max;
+		if (**p == '*') {
+			min = 0;
+			max = -1;
+			(*p)++;
+		} else if (**p == '+') {
+			min = 1;
+			max = -1;
+			(*p)++;
+		} else if (**p == '?') {
+			min = 0;
+			max = 1;
+			(*p)++;
+		} else if (**p != '{' || !regex_parse_bound(re, p, &min, &max)) {
+			break;
+		}
+		node = regex_node_new(re, RE_REPEAT, node, 0);
+		re->nodes[node].min = min;
+		re->nodes[node].max = max;
+	}
+	return re->error ? -1 : node;
+}
+
+int regex_parse_cat(regex *re, const char **p)
+{
+	int node = -1;
+	while (**p && **p != '|' && **p != ')') {
+		int next = regex_parse_repeat(re, p);
+		if (next == -1) return -1;
+		node = node == -1 ? next : regex_node_new(re, RE_CAT, node, next);
+	}
+	return node == -1 ? regex_node_new(re, RE_EMPTY, 0, 0) : node;
+}
+
+int regex_parse_alt(regex *re, const char **p)
+{
+	int node = regex_parse_cat(re, p);
+	while (node != -1 && **p == '|') {
+		(*p)++;
+		int next = regex_parse_cat(re, p);
+		if (next == -1) return -1;
+		node = regex_node_new(re, RE_ALT, node, next);
+	}
+	return node;
+}
+
+int regex_state_new(regex *re)
+{
+	if (re->nstates == KILO_REGEX_STATES) re->error = "regex too big";
+	return re->nstates++;
+}
+
+void regex_edge(regex *re, int from, int to, int label)
+{
+	if (re->nedges == re->ecap) {
+		re->ecap = re->ecap ? re->ecap * 2 : 64;
+		re->edges = realloc(re->edges, sizeof(int) * 3 * re->ecap);
+	}
+	re->edges[re->nedges * 3] = from;
+	re->edges[re->nedges * 3 + 1] = to;
+	re->edges[re->nedges * 3 + 2] = label;
+	if (++re->nedges == KILO_REGEX_STATES * 4) re->error = "regex too big";
+}
+
+/* add the edges and states that match node going from state from to state to.
+ * A loop always gets a state of its own, so nothing else can get into it.
+ */
+void regex_compile_node(regex *re, int node, int from, int to)
+{
+	regex_node *n = &re->nodes[node];
+	int mid, cur, i;
+
+	if (re->error) return;
+	switch (n->type) {
+		case RE_EMPTY:
+			regex_edge(re, from, to, RE_EDGE_EMPTY);
+			break;
+		case RE_CLASS:
+			regex_edge(re, from, to, n->a);
+			break;
+		case RE_BEGIN:
+			regex_edge(re, from, to, RE_EDGE_BEGIN);
+			break;
+		case RE_END:
+			regex_edge(re, from, to, RE_EDGE_END);
+			break;
+		case RE_CAT:
+			mid = regex_state_new(re);
+			regex_compile_node(re, n->a, from, mid);
+			regex_compile_node(re, n->b, mid, to);
+			break;
+		case RE_ALT:
+			regex_compile_node(re, n->a, from, to);
+			regex_compile_node(re, n->b, from, to);
+			break;
+		case RE_REPEAT:
+			/* the required copies first, then a loop or the optional copies. */
+			cur = from;
+			for (i = 0; i < n->min; i++) {
+				int next = (i == n->min - 1 && n->max == n->min) ? to : regex_state_new(re);
+				regex_compile_node(re, n->a, cur, next);
+				cur = next;
+			}
+			if (n->max == -1) {
+				mid = regex_state_new(re);
+				regex_edge(re, cur, mid, RE_EDGE_EMPTY);
+				regex_compile_node(re, n->a, mid, mid);
+				regex_edge(re, mid, to, RE_EDGE_EMPTY);
+			} else if (n->max == 0) {
+				regex_edge(re, from, to, RE_EDGE_EMPTY);
+			}
+			for (i = n->min; i < n->max; i++) {
+				int next = i == n->max - 1 ? to : regex_state_new(re);
+				regex_edge(re, cur, to, RE_EDGE_EMPTY);
+				regex_compile_node(re, n->a, cur, next);
+				cur = next;
+			}
+			break;
+	}
+}
+
+/* lay the edges of re out as an NFA, going backwards if reverse is set. */
+void regex_build_nfa(regex *re, nfa *a, int reverse)
+{
+	a->nstates = re->nstates;
+	a->start = reverse ? 1 : 0;
+	a->accept = reverse ? 0 : 1;
+	a->classes = re->classes;
+	a->off = calloc(re->nstates + 1, sizeof(int));
+	a->to = malloc(sizeof(int) * (re->nedges + 1));
+	a->label = malloc(sizeof(int) * (re->nedges + 1));
+
+	int i;
+	for (i = 0; i < re->nedges; i++) a->off[re->edges[i * 3 + reverse] + 1]++;
+	for (i = 0; i < re->nstates; i++) a->off[i + 1] += a->off[i];
+	int *fill = malloc(sizeof(int) * (re->nstates + 1));
+	memcpy(fill, a->off, sizeof(int) * (re->nstates + 1));
+	for (i = 0; i < re->nedges; i++) {
+		int from = re->edges[i * 3 + reverse];
+		int label = re->edges[i * 3 + 2];
+		/* going backwards the beginning of the text is where it ends. */
+		if (reverse && label == RE_EDGE_BEGIN) label = RE_EDGE_END;
+		else if (reverse && label == RE_EDGE_END) label = RE_EDGE_BEGIN;
+		a->to[fill[from]] = re->edges[i * 3 + !reverse];
+		a->label[fill[from]++] = label;
+	}
+	free(fill);
+}
+
+/* return the byte if set holds just one, -1 otherwise. */
+int regex_class_byte(const unsigned char *set)
+{
+	int i, c = -1;
+	for (i = 0; i < 32; i++) {
+		if (set[i] == 0) continue;
+		if (c != -1 || (set[i] & (set[i] - 1))) return -1;
+		c = i * 8 + __builtin_ctz(set[i]);
+	}
+	return c;
+}
+
+/* find the longest run of single bytes in a row that every match has to contain.
+ * cur holds the run that ends where node starts.
+ */
+void regex_find_literal(regex *re, int node, char *cur, int *curlen)
+{
+	regex_node *n = &re->nodes[node];
+	if (n->type == RE_CAT) {
+		regex_find_literal(re, n->a, cur, curlen);
+		regex_find_literal(re, n->b, cur, curlen);
+		return;
+	}
+	int c = n->type == RE_CLASS ? regex_class_byte(re->classes[n->a]) : -1;
+	if (c == -1) {
+		*curlen = 0;
+		return;
+	}
+	cur[(*curlen)++] = c;
+	if (*curlen > re->literal_len) {
+		re->literal_len = *curlen;
+		memcpy(re->literal, cur, *curlen);
+	}
+}
+
+void dfa_init(dfa *d, nfa *a, int unanchored)
+{
+	d->nfa = a;
+	d->unanchored = unanchored;
+	d->states = malloc(sizeof(dstate) * KILO_DFA_STATES);
+	d->n = 0;
+	d->flushes = 0;
+	d->table = malloc(sizeof(int) * KILO_DFA_STATES * 2);
+	memset(d->table, 0xff, sizeof(int) * KILO_DFA_STATES * 2);
+	d->start[0] = -1;
+	d->start[1] = -1;
+	d->stack = malloc(sizeof(int) * a->nstates);
+	d->set = malloc(sizeof(int) * a->nstates);
+	d->mark = calloc(a->nstates, sizeof(unsigned int));
+	d->gen = 0;
+}
+
+/* throw away all the states built so far, to bound the memory a DFA uses. */
+void dfa_flush(dfa *d)
+{
+	int i;
+	for (i = 0; i < d->n; i++) free(d->states[i].set);
+	d->n = 0;
+	d->flushes++;
+	memset(d->table, 0xff, sizeof(int) * KILO_DFA_STATES * 2);
+	d->start[0] = -1;
+	d->start[1] = -1;
+}
+
+void dfa_free(dfa *d)
+{
+	if (d->states == NULL) return;
+	dfa_flush(d);
+	free(d->states);
+	free(d->table);
+	free(d->stack);
+	free(d->set);
+	free(d->mark);
+}
+
+/* start building a new set of NFA states. */
+void dfa_new_set(dfa *d)
+{
+	if (++d->gen == 0) {
+		memset(d->mark, 0, sizeof(unsigned int) * d->nfa->nstates);
+		d->gen = 1;
+	}
+}
+
+/* add state s and the states reachable from it without consuming a byte to the set
+ * being built. Anchor edges are only followed at the beginning or end of the text.
+ */
+void dfa_closure(dfa *d, int s, int *n, int begin, int end)
+{
+	nfa *a = d->nfa;
+	int sp = 0;
+
+	if (d->mark[s] == d->gen) return;
+	d->mark[s] = d->gen;
+	d->set[(*n)++] = s;
+	d->stack[sp++] = s;
+	while (sp > 0) {
+		int u = d->stack[--sp];
+		int i;
+		for (i = a->off[u]; i < a->off[u + 1]; i++) {
+			int label = a->label[i];
+			if (label >= 0 || (label == RE_EDGE_BEGIN && !begin) || (label == RE_EDGE_END && !end)) continue;
+			int v = a->to[i];
+			if (d->mark[v] == d->gen) continue;
+			d->mark[v] = d->gen;
+			d->set[(*n)++] = v;
+			d->stack[sp++] = v;
+		}
+	}
+}
+
+int int_cmp(const void *a, const void *b)
+{
+	int x = *(const int *) a, y = *(const int *) b;
+	return (x > y) - (x < y);
+}
+
+/* return the DFA state for the first n NFA states in d->set, adding it if it is new. */
+int dfa_state(dfa *d, int n)
+{
+	qsort(d->set, n, sizeof(int), int_cmp);
+	unsigned int h = 2166136261u;
+	int i;
+	for (i = 0; i < n; i++) h = (h ^ d->set[i]) * 16777619u;
+
+	int mask = KILO_DFA_STATES * 2 - 1;
+	int slot = h & mask;
+	while (d->table[slot] != -1) {
+		dstate *st = &d->states[d->table[slot]];
+		if (st->n == n && memcmp(st->set, d->set, sizeof(int) * n) == 0) return d->table[slot];
+		slot = (slot + 1) & mask;
+	}
+	if (d->n == KILO_DFA_STATES) {
+		dfa_flush(d);
+		slot = h & mask;
+	}
+
+	dstate *st = &d->states[d->n];
+	st->set = malloc(sizeof(int) * (n + 1));
+	memcpy(st->set, d->set, sizeof(int) * n);
+	st->n = n;
+	memset(st->next, 0xff, sizeof(st->next));
+
+	/* whether it accepts at the end of the text depends on the edges of $ anchors. */
+	int m = 0;
+	dfa_new_set(d);
+	for (i = 0; i < n; i++) dfa_closure(d, st->set[i], &m, 0, 1);
+	st->accept_end = d->mark[d->nfa->accept] == d->gen;
+	st->accept = bsearch(&d->nfa->accept, st->set, n, sizeof(int), int_cmp) != NULL;
+
+	d->table[slot] = d->n;
+	return d->n++;
+}
+
+/* the state a search starts in, at the beginning of the text or somewhere else. */
+int dfa_start(dfa *d, int begin)
+{
+	if (d->start[begin] == -1) {
+		int n = 0;
+		dfa_new_set(d);
+		dfa_closure(d, d->nfa->start, &n, begin, 0);
+		int s = dfa_state(d, n);
+		d->start[begin] = s;
+	}
+	return d->start[begin];
+}
+
+/* the state after state s consumes byte c. */
+int dfa_next(dfa *d, int s, unsigned char c)
+{
+	int t = d->states[s].next[c];
+	if (t != -1) return t;
+
+	nfa *a = d->nfa;
+	dstate *st = &d->states[s];
+	int n = 0, i, j;
+	dfa_new_set(d);
+	for (j = 0; j < st->n; j++) {
+		int u = st->set[j];
+		for (i = a->off[u]; i < a->off[u + 1]; i++) {
+			int label = a->label[i];
+			if (label >= 0 && (a->classes[label][c >> 3] & (1 << (c & 7))))
+				dfa_closure(d, a->to[i], &n, 0, 0);
+		}
+	}
+	if (d->unanchored) dfa_closure(d, a->start, &n, 0, 0);
+
+	/* building the state may have thrown s away. */
+	unsigned int flushes = d->flushes;
+	t = dfa_state(d, n);
+	if (d->flushes == flushes) d->states[s].next[c] = t;
+	return t;
+}
+
+void regex_free(regex *re)
+{
+	if (re == NULL) return;
+	free(re->nodes);
+	free(re->classes);
+	free(re->edges);
+	nfa *a[2] = {&re->fwd, &re->rev};
+	int i;
+	for (i = 0; i < 2; i++) {
+		free(a[i]->off);
+		free(a[i]->to);
+		free(a[i]->label);
+	}
+	dfa_free(&re->match);
+	dfa_free(&re->starts);
+	free(re->literal);
+	free(re);
+}
+
+/* compile pattern, or return NULL and point *error at what is wrong with it. */
+regex *regex_compile(const char *pattern, const char **error)
+{
+	regex *re = calloc(1, sizeof(regex));
+	/* state 0 is where a match starts, state 1 where it ends. */
+	regex_state_new(re);
+	regex_state_new(re);
+
+	const char *p = pattern;
+	int root = regex_parse_alt(re, &p);
+	if (root != -1 && *p == ')') re->error = "unmatched )";
+	if (re->error == NULL) regex_compile_node(re, root, 0, 1);
+	if (re->error) {
+		*error = re->error;
+		regex_free(re);
+		return NULL;
+	}
+
+	size_t len = strlen(pattern);
+	char *cur = malloc(len + 1);
+	int curlen = 0;
+	re->literal = malloc(len + 1);
+	regex_find_literal(re, root, cur, &curlen);
+	free(cur);
+
+	regex_build_nfa(re, &re->fwd, 0);
+	regex_build_nfa(re, &re->rev, 1);
+	dfa_init(&re->match, &re->fwd, 0);
+	dfa_init(&re->starts, &re->rev, 1);
+	return re;
+}
+
+/* the number of windows of KILO_REGEX_WINDOW bytes a row of len bytes is marked in, an empty row has one. */
+size_t regex_windows(size_t len)
+{
+	return len == 0 ? 1 : (len - 1) / KILO_REGEX_WINDOW + 1;
+}
+
+/* keep DFA state st of d as the state at the end of the next window down. */
+void regex_keep_state(search_scan *sc, dfa *d, int st)
+{
+	dstate *ds = &d->states[st];
+	if (sc->nsets + ds->n > sc->setcap) {
+		sc->setcap = (sc->nsets + ds->n) * 2;
+		sc->sets = realloc(sc->sets, sizeof(int) * sc->setcap);
+	}
+	if (sc->nkept + 2 > sc->keptcap) {
+		sc->keptcap = (sc->nkept + 2) * 2;
+		sc->set_off = realloc(sc->set_off, sizeof(size_t) * sc->keptcap);
+	}
+	memcpy(&sc->sets[sc->nsets], ds->set, sizeof(int) * ds->n);
+	sc->set_off[sc->nkept] = sc->nsets;
+	sc->nsets += ds->n;
+	sc->set_off[++sc->nkept] = sc->nsets;
+}
+
+/* return the DFA state of d kept for the end of window w. Only the NFA states are kept, since the
+ * DFA may have been thrown away and built again since.
+ */
+int regex_kept_state(search_scan *sc, dfa *d, size_t w)
+{
+	size_t k = regex_windows(sc->len) - 1 - w;
+	int n = sc->set_off[k + 1] - sc->set_off[k];
+	memcpy(d->set, &sc->sets[sc->set_off[k]], sizeof(int) * n);
+	return dfa_state(d, n);
+}
+
+/* run the regex backwards over one more window of the row t, return 1 once it has been over all of it. */
+int regex_scan_back(regex *re, search_scan *sc, lex_text *t)
+{
+	dfa *d = &re->starts;
+	size_t nwin = regex_windows(sc->len);
+	if (sc->nkept == 0) regex_keep_state(sc, d, dfa_start(d, 1));
+	if (sc->nkept == nwin) return 1;
+
+	/* the window whose state was kept last, going through it gives the state at the end of the one before. */
+	size_t w = nwin - sc->nkept;
+	int st = regex_kept_state(sc, d, w);
+	size_t i;
+	for (i = sc->back; i-- > w * KILO_REGEX_WINDOW; ) st = dfa_next(d, st, TEXT_AT(t, i));
+	regex_keep_state(sc, d, st);
+	sc->back = w * KILO_REGEX_WINDOW;
+	return sc->nkept == nwin;
+}
+
+/* mark the offsets in window w of the row t where a match starts, going backwards from its end. */
+void regex_mark(regex *re, search_scan *sc, lex_text *t, size_t w)
+{
+	if (sc->starts_at == NULL) sc->starts_at = malloc(KILO_REGEX_WINDOW);
+	dfa *d = &re->starts;
+	size_t start = w * KILO_REGEX_WINDOW;
+	size_t end = sc->len - start > KILO_REGEX_WINDOW ? start + KILO_REGEX_WINDOW : sc->len;
+	int st = regex_kept_state(sc, d, w);
+	size_t i;
+	for (i = end; i-- > start; ) {
+		st = dfa_next(d, st, TEXT_AT(t, i));
+		sc->starts_at[i - start] = i == 0 ? d->states[st].accept_end : d->states[st].accept;
+	}
+	sc->base = start;
+}
+
+/* return where the longest match starting at offset start of t ends, or start if there is none. */
+size_t regex_match_end(regex *re, lex_text *t, size_t start)
+{
+	dfa *d = &re->match;
+	size_t len = t->len;
+	int st = dfa_start(d, start == 0);
+	size_t end = start;
+	size_t i;
+	for (i = start; ; i++) {
+		dstate *ds = &d->states[st];
+		if (i == len ? ds->accept_end : ds->accept) end = i;
+		if (i == len || ds->n == 0) break;
+		st = dfa_next(d, st, TEXT_AT(t, i));
+	}
+	return end;
+}
+
+/*** find ***/
+/* Substring search. Candidate positions are found by comparing the first and the last
+ * byte of the needle against a whole vector of positions at once, only those positions
+ * are then compared in full. Whatever is left at the end is handed to memmem().
+ */
+
+#ifdef KILO_X86
+__attribute__((target("avx2")))
+const char *search_mem_avx2(const char *s, size_t len, const char *needle, size_t nlen)
+{
+	const __m256i first = _mm256_set1_epi8(needle[0]);
+	const __m256i last = _mm256_set1_epi8(needle[nlen - 1]);
+	size_t i;
+	for (i = 0; i + nlen - 1 + 32 <= len; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *) (s + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *) (s + i + nlen - 1));
+		unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+		while (mask) {
+			size_t j = i + __builtin_ctz(mask);
+			if (memcmp(s + j + 1, needle + 1, nlen - 2) == 0) return s + j;
+			mask &= mask - 1;
+		}
+	}
+	return memmem(s + i, len - i, needle, nlen);
+}
+
+#ifdef __SSE2__
+const char *search_mem_sse2(const char *s, size_t len, const char *needle, size_t nlen)
+{
+	const __m128i first = _mm_set1_epi8(needle[0]);
+	const __m128i last = _mm_set1_epi8(needle[nlen - 1]);
+	size_t i;
+	for (i = 0; i + nlen - 1 + 16 <= len; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *) (s + i));
+		__m128i b = _mm_loadu_si128((const __m128i *) (s + i + nlen - 1));
+		unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+		while (mask) {
+			size_t j = i + __builtin_ctz(mask);
+			if (memcmp(s + j + 1, needle + 1, nlen - 2) == 0) return s + j;
+			mask &= mask - 1;
+		}
+	}
+	return memmem(s + i, len - i, needle, nlen);
+}
+#endif
+#endif
+
+/* return the first occurrence of the nlen bytes of needle in the len bytes of s, or NULL. */
+const char *search_mem(const char *s, size_t len, const char *needle, size_t nlen)
+{
+	if (nlen == 0) return s;
+	if (nlen > len) return NULL;
+	if (nlen == 1) return memchr(s, needle[0], len);
+#ifdef KILO_X86
+	if (__builtin_cpu_supports("avx2")) return search_mem_avx2(s, len, needle, nlen);
+#ifdef __SSE2__
+	return search_mem_sse2(s, len, needle, nlen);
+#endif
+#endif
+	return memmem(s, len, needle, nlen);
+}
+
+/* return the offset of the first occurrence of the nlen bytes of needle, at least one, in t that starts at or
+ * after from and before stop, or NO_ROW. The chars before the gap and after it are searched where they are, and
+ * the few places a match could span the gap are compared on their own.
+ */
+size_t text_find(lex_text *t, size_t from, size_t stop, const char *needle, size_t nlen)
+{
+	if (stop > t->len) stop = t->len;
+	if (from >= stop || nlen > t->len - from) return NO_ROW;
+	size_t end = t->len - stop > nlen - 1 ? stop + nlen - 1 : t->len;	/* a match has to end by here. */
+
+	if (from < t->gap) {
+		size_t before = end < t->gap ? end : t->gap;
+		const char *hit = search_mem(&t->s[from], before - from, needle, nlen);
+		if (hit) return hit - t->s;
+		if (end <= t->gap) return NO_ROW;
+		size_t i = t->gap - from >= nlen ? t->gap - nlen + 1 : from;
+		for (; i < t->gap && i < stop; i++)
+			if (text_match(t, i, needle, nlen)) return i;
+	}
+	size_t i = from > t->gap ? from : t->gap;
+	if (i >= stop) return NO_ROW;
+	const char *after = &t->s[t->gaplen];
+	const char *hit = search_mem(&after[i], end - i, needle, nlen);
+	return hit ? (size_t) (hit - after) : NO_ROW;
+}
+
+/* make query what is searched for, as a regex if regex is set. */
+void search_set(const char *query, int regex)
+{
+	search_clear();
+	E.search.text = strdup(query);
+	E.search.len = strlen(query);
+	E.search.regex = regex;
+	E.search.error = NULL;
+	if (regex && query[0] != '\0') E.search.re = regex_compile(query, &E.search.error);
+}
+
+/* forget which rows are known not to match, the rows have changed or the query starts over. */
+void search_skip_reset(void)
+{
+	free(E.search.skip);
+	free(E.search.skip_query);
+	E.search.skip = NULL;
+	E.search.skip_query = NULL;
+}
+
+void search_clear(void)
+{
+	free(E.search.text);
+	regex_free(E.search.re);
+	E.search.text = NULL;
+	E.search.re = NULL;
+	E.search.error = NULL;
+}
+
+/* get sc ready to search a row of len chars from its start. */
+void search_scan_reset(search_scan *sc, size_t len)
+{
+	sc->len = len;
+	sc->from = 0;
+	sc->back = len;
+	sc->nsets = 0;
+	sc->nkept = 0;
+	sc->base = NO_ROW;
+}
+
+/* Look for the next match of the search in the chars of the row sc was reset for, doing at most about
+ * a window of regex work or a scan batch of substring search. Return 1 and store the offset of the match
+ * in *col and its length in *mlen, 0 if there are no more in the row, or -1 if it has to be called again
+ * to tell. The same chars have to be passed until it returns 0.
+ */
+int search_step(search_scan *sc, lex_text *t, size_t *col, size_t *mlen)
+{
+	search_query *q = &E.search;
+	size_t len = sc->len;
+	if (q->len == 0 || (q->regex && q->re == NULL)) {
+		sc->from = len;
+		return 0;
+	}
+
+	if (!q->regex) {
+		size_t end = len - sc->from > KILO_SCAN_BATCH ? sc->from + KILO_SCAN_BATCH : len;
+		/* matches that start before end may run on past it. */
+		size_t hit = text_find(t, sc->from, end, q->text, q->len);
+		if (hit == NO_ROW) {
+			sc->from = end;
+			return end == len ? 0 : -1;
+		}
+		*col = hit;
+		*mlen = q->len;
+		sc->from = *col + q->len;
+		return 1;
+	}
+
+	regex *re = q->re;
+	if (sc->nkept == 0 && len <= KILO_SCAN_BATCH && re->literal_len > 0 &&
+		text_find(t, 0, len, re->literal, re->literal_len) == NO_ROW) {
+		/* rule most rows out at the speed of a substring search. */
+		sc->from = len;
+		return 0;
+	}
+	if (!regex_scan_back(re, sc, t)) return -1;
+
+	int marked = 0;
+	while (sc->from < len) {
+		size_t w = sc->from / KILO_REGEX_WINDOW;
+		if (sc->base != w * KILO_REGEX_WINDOW) {
+			if (marked) return -1;
+			regex_mark(re, sc, t, w);
+			marked = 1;
+		}
+		size_t end = len - sc->base > KILO_REGEX_WINDOW ? sc->base + KILO_REGEX_WINDOW : len;
+		unsigned char *hit = memchr(&sc->starts_at[sc->from - sc->base], 1, end - sc->from);
+		if (hit == NULL) {
+			sc->from = end;
+			continue;
+		}
+		size_t start = sc->base + (hit - sc->starts_at);
+		size_t match_end = regex_match_end(re, t, start);
+		if (match_end > start) {
+			*col = start;
+			*mlen = match_end - start;
+			sc->from = match_end;
+			return 1;
+		}
+		sc->from = start + 1;
+	}
+	return 0;
+}
+
+/* find the next match in the row sc was reset for however long that takes, see search_step(). */
+int search_row(search_scan *sc, lex_text *t, size_t *col, size_t *mlen)
+{
+	int found;
+	while ((found = search_step(sc, t, col, mlen)) == -1);
+	return found;
+}
+
+
+/*** match counting ***/
+/* While a search prompt is open a worker thread finds all the matches of the query and
+ * records them in E.matches, for the "match 17 of 4,213" in the status bar and so that
+ * moving between matches is a binary search of that table.
+ */
+
+void match_push(match_table *mt, size_t row, size_t col, size_t len)
+{
+	if (mt->n == mt->cap) {
+		mt->cap = mt->cap ? mt->cap * 2 : 256;
+		mt->m = realloc(mt->m, sizeof(match) * mt->cap);
+	}
+	mt->m[mt->n].row = row;
+	mt->m[mt->n].col = col;
+	mt->m[mt->n].len = len;
+	mt->n++;
+}
+
+/* return the first row from row on that the query can be in. */
+size_t match_next_row(match_table *mt, size_t row)
+{
+	while (mt->next_keep < mt->nkeep && mt->keep[mt->next_keep] < row) mt->next_keep++;
+	if (row >= mt->rest) return row;
+	return mt->next_keep < mt->nkeep ? mt->keep[mt->next_keep] : mt->rest;
+}
+
+void *match_thread(void *arg)
+{
+	(void) arg;
+	match_table *mt = &E.matches;
+	struct timespec last;
+	clock_gettime(CLOCK_MONOTONIC, &last);
+
+	pthread_mutex_lock(&E.lock);
+	mt->scanned = match_next_row(mt, mt->scanned);
+	while (!mt->cancel && mt->scanned < E.numrows) {
+		/* a slow regex can take much longer over a batch than a substring does, so batches are cut short by time
+		 * too, otherwise it would hold up the screen.
+		 */
+		size_t bytes = 0;
+		long spent = 0;
+		struct timespec batch;
+		clock_gettime(CLOCK_MONOTONIC, &batch);
+		size_t steps = 0;
+		while (mt->scanned < E.numrows && bytes < KILO_SCAN_BATCH && spent < KILO_PROGRESS_MS) {
+			size_t col, mlen;
+			lex_text t;
+			row_read(mt->scanned, &t);
+			size_t len = t.len;
+			search_scan *sc = &mt->scan;
+			if (!mt->partway || sc->len != len) {
+				/* a long row is searched a step at a time, and may have changed while the lock was let go. */
+				while (mt->n > 0 && mt->m[mt->n - 1].row == mt->scanned) mt->n--;
+				search_scan_reset(sc, len);
+				mt->partway = 1;
+			}
+			size_t from = sc->from, back = sc->back;
+			int found = search_step(sc, &t, &col, &mlen);
+			if (found == 1) match_push(mt, mt->scanned, col, mlen);
+			bytes += (sc->from - from) + (back - sc->back);
+			if (found == 0) {
+				bytes++;
+				mt->scanned = match_next_row(mt, mt->scanned + 1);
+				mt->partway = 0;
+			}
+			if (found == -1 || ++steps % 64 == 0) spent += elapsed_ms(&batch);
+		}
+		if (elapsed_ms(&last) >= KILO_PROGRESS_MS) editor_wake();
+		worker_yield();
+	}
+	if (!mt->cancel) mt->done = 1;
+	pthread_mutex_unlock(&E.lock);
+	editor_wake();
+	return NULL;
+}
+
+/* stop counting matches and forget them. If narrow is set the next query contains this one, so it can only be in
+ * the rows this one was found in and the rows not scanned yet, and the next scan is kept to those.
+ */
+void match_scan_stop(int narrow)
+{
+	match_table *mt = &E.matches;
+	if (mt->active) {
+		mt->cancel = 1;
+		editor_unlock();
+		pthread_join(mt->thread, NULL);
+		editor_lock();
+		mt->active = 0;
+	}
+	size_t *keep = NULL, nkeep = 0;
+	if (narrow) {
+		/* the rows above scanned have been searched, the ones still to do are what is left of keep and rest. */
+		keep = malloc(sizeof(size_t) * (mt->n + mt->nkeep - mt->next_keep + 1));
+		size_t i;
+		for (i = 0; i < mt->n && mt->m[i].row < mt->scanned; i++)
+			if (nkeep == 0 || keep[nkeep - 1] != mt->m[i].row) keep[nkeep++] = mt->m[i].row;
+		for (i = mt->next_keep; i < mt->nkeep; i++)
+			if (mt->keep[i] >= mt->scanned) keep[nkeep++] = mt->keep[i];
+		if (mt->rest < mt->scanned) mt->rest = mt->scanned;
+	} else {
+		mt->rest = 0;
+	}
+	free(mt->keep);
+	mt->keep = keep;
+	mt->nkeep = nkeep;
+	mt->next_keep = 0;
+	mt->n = 0;
+	mt->done = 0;
+	mt->scanned = 0;
+	mt->partway = 0;
+	mt->cur_row = NO_ROW;
+}
+
+/* start counting the matches of the search in the background. */
+void match_scan_start(void)
+{
+	match_table *mt = &E.matches;
+	if (E.search.len == 0 || (E.search.regex && E.search.re == NULL)) return;
+
+	mt->cancel = 0;
+	if (pthread_create(&mt->thread, NULL, match_thread, NULL) != 0) die("pthread_create");
+	mt->active = 1;
+}
+
+/* compare two positions in the file. */
+int match_cmp(size_t row1, size_t col1, size_t row2, size_t col2)
+{
+	if (row1 != row2) return row1 < row2 ? -1 : 1;
+	if (col1 != col2) return col1 < col2 ? -1 : 1;
+	return 0;
+}
+
+/* return the index of the first match found so far at or after row, col. */
+size_t match_lower_bound(size_t row, size_t col)
+{
+	match_table *mt = &E.matches;
+	size_t lo = 0, hi = mt->n;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (match_cmp(mt->m[mid].row, mt->m[mid].col, row, col) < 0) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+/* write n with thousands separators into buf. */
+int format_count(char *buf, size_t size, size_t n)
+{
+	char digits[32];
+	int len = snprintf(digits, sizeof(digits), "%zu", n);
+	char out[48];
+	int i, j = 0;
+	for (i = 0; i < len; i++) {
+		if (i > 0 && (len - i) % 3 == 0) out[j++] = ',';
+		out[j++] = digits[i];
+	}
+	out[j] = '\0';
+	return snprintf(buf, size, "%s", out);
+}
+
+/* describe where the cursor is among the matches for the status bar, 0 if there is no search. */
+int match_status(char *buf, size_t size)
+{
+	match_table *mt = &E.matches;
+	if (E.search.text == NULL) return 0;
+	if (E.search.error) return snprintf(buf, size, "%s | ", E.search.error);
+
+	char index[48], total[48];
+	size_t i = match_lower_bound(mt->cur_row, mt->cur_col);
+	if (mt->cur_row != NO_ROW && i < mt->n && mt->m[i].row == mt->cur_row && mt->m[i].col == mt->cur_col)
+		format_count(index, sizeof(index), i + 1);
+	else
+		snprintf(index, sizeof(index), "?");
+	format_count(total, sizeof(total), mt->n);
+
+	if (mt->done)
+		return snprintf(buf, size, "match %s of %s | ", index, total);
+	int percent = E.numrows ? (int) (mt->scanned * 100 / E.numrows) : 100;
+	return snprintf(buf, size, "match %s of %s (%d%%) | ", index, total, percent);
+}
+
+void find_callback(char *query, int key)
+{
+	static size_t last_match = NO_ROW;
+	static size_t last_col = 0;
+	static int direction = 1;
+	/* set when the next match wasn't in reach yet, it is looked for again as the worker finds more. */
+	static int waiting = 0;
+
+	search_query *q = &E.search;
+	match_table *mt = &E.matches;
+	if (key == PROMPT_IDLE && !waiting) return;
+	mt->cur_len = 0;
+
+	if (key == '\r' || key == '\x1b') {
+		/* reset values before canceling. */
+		last_match = NO_ROW;
+		direction = 1;
+		waiting = 0;
+		search_skip_reset();
+		match_scan_stop(0);
+		search_clear();
+		return;
+	} else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+		direction = 1;
 	} else if (key == ARROW_LEFT || key == ARROW_UP) {
 		direction = -1;
+	} else if (key == PROMPT_IDLE) {
+		/* keep looking from where the last key left off. */
 	} else {
-		last_match = -1;
+		last_match = NO_ROW;
 		direction = 1;
 	}
 
-	if (last_match == -1) direction= 1;
-	/* jump to the the row of the last match so we start searching from there. */
-	int current = last_match;
-	int i;
-	for (i = 0; i < E.numrows; i++) {
-		/* one step forward/backward according to the direction. */
+	if (E.search.text == NULL || strcmp(query, E.search.text) != 0) {
+		/* a literal query that contains the last one can only be where the last one is, the skip bitmap
+		 * being kept means the rows haven't changed since.
+		 */
+		int narrow = q->skip != NULL && !q->regex && E.search.len > 0 && strstr(query, E.search.text) != NULL;
+		match_scan_stop(narrow);
+		search_set(query, E.search.regex);
+		match_scan_start();
+	}
+	if (query[0] == '\0') {
+		/* an empty query matches nowhere, which mustn't rule any row out for the next one. */
+		search_skip_reset();
+		waiting = 0;
+		return;
+	}
+
+	/* a longer regex can match where a shorter one didn't, so only literal text rules rows out for good. */
+	if (q->skip == NULL || strstr(query, q->skip_query) == NULL || (q->regex && strcmp(query, q->skip_query) != 0)) {
+		/* not a longer version of the last query, so nothing is ruled out yet. */
+		free(q->skip);
+		q->skip = calloc(E.numrows / 8 + 1, 1);
+	}
+	free(q->skip_query);
+	q->skip_query = strdup(query);
+
+	if (last_match == NO_ROW) direction = 1;
+
+	/* look for the next match in the table the worker has built so far, the rows it has got through are done. */
+	match found = {NO_ROW, 0, 0};
+	if (last_match == NO_ROW) {
+		if (mt->n > 0) found = mt->m[0];
+	} else if (mt->n > 0) {
+		size_t i = match_lower_bound(last_match, last_col);
+		if (direction == 1) {
+			if (i < mt->n && match_cmp(mt->m[i].row, mt->m[i].col, last_match, last_col) == 0) i++;
+			if (i < mt->n) found = mt->m[i];
+			else if (mt->done) found = mt->m[0];
+		} else {
+			if (i > 0 && (mt->done || mt->scanned > last_match)) found = mt->m[i - 1];
+			else if (i == 0 && mt->done) found = mt->m[mt->n - 1];
+		}
+	}
+
+	/* the worker hasn't got there yet, so search the rows one by one, but only as far as KILO_FIND_WINDOW bytes
+	 * take us. Further than that waits for the worker, a search with no match would otherwise go through the whole
+	 * file before the next key.
+	 */
+	size_t current = last_match;
+	size_t i, bytes = 0;
+	for (i = 0; found.row == NO_ROW && key != PROMPT_IDLE && !mt->done && i < E.numrows; i++) {
+		/* one step forward/backward according to the direction, NO_ROW steps forward to row 0. */
 		current += direction;
 		/* wrap around by jumping to the end of the file. */
-		if (current == -1) {
+		if (current == NO_ROW) {
 			current = E.numrows - 1;
 		} else if (current == E.numrows) {
 			current = 0;
 		}
-		erow *row = &E.row[current];
-		/* strstr() comes from <string.h>.
-		 * Checks if query is a substring of row->render.
-		 * Returns NULL if there is no match, and a pointer to the maatching substring. */
-		char *match = strstr(row->render, query);
-		if (match) {
-			/* update last match. */
-			last_match = current;
-			/* jump to current match row. */
-			E.cy = current;
-			E.cx = row_rx_to_cx(row, match - row->render);
-			E.rowoff = E.numrows;
-
-			saved_hl_line = current;
-			saved_hl = malloc(row->rsize);
-			/* save the contents of row.hl to saved_hl before modifying. */
-			memcpy(saved_hl, row->hl, row->rsize);
-			memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
+		if (q->skip[current / 8] & (1 << (current % 8))) continue;
 
-			break;
+		/* search the characters of the row without loading it. */
+		lex_text t;
+		row_read(current, &t);
+		bytes += t.len + 1;
+		if (bytes > KILO_FIND_WINDOW) break;
+		search_scan_reset(&q->scan, t.len);
+		if (!search_row(&q->scan, &t, &found.col, &found.len)) {
+			q->skip[current / 8] |= 1 << (current % 8);
+			continue;
 		}
+		found.row = current;
 	}
+	waiting = found.row == NO_ROW && mt->active && !mt->done;
+	if (found.row == NO_ROW) return;
+
+	/* update last match. */
+	last_match = found.row;
+	last_col = found.col;
+	mt->cur_row = found.row;
+	mt->cur_col = found.col;
+	mt->cur_len = found.len;
+	/* jump to current match row. */
+	E.cy = found.row;
+	E.cx = found.col;
+	E.rowoff = E.numrows;
 }
 
-void editor_find(void)
+/* search for literal text, or for a regex if regex is set. */
+void editor_find(int regex)
 {
-	int saved_cx = E.cx;
-	int saved_cy = E.cy;
-	int saved_coloff = E.coloff;
-	int saved_rowoff = E.rowoff;
+	size_t saved_cx = E.cx;
+	size_t saved_cy = E.cy;
+	size_t saved_coloff = E.coloff;
+	size_t saved_rowoff = E.rowoff;
 
-	char *query = editor_prompt("Search: %s (ESC to cancel)", find_callback);
+	E.search.regex = regex;
+	char *query = editor_prompt(regex ? "Regex: %s (ESC to cancel)" : "Search: %s (ESC to cancel)", find_callback);
 	
 	if (query) {
 		free(query);
@@ -541,243 +4190,1054 @@ void editor_find(void)
 	}
 }
 
+/*** replace ***/
+
+/* replace every occurrence in row at, rebuilding the row in a single allocation. return how many there were. */
+size_t row_replace(replace_job *job, size_t at)
+{
+	size_t len;
+	char *chars = row_peek(at, &len);
+	const char *p = chars, *hit;
+	size_t n = 0;
+	while ((hit = search_mem(p, chars + len - p, job->find, job->flen)) != NULL) {
+		if (n == job->cap) {
+			job->cap = job->cap ? job->cap * 2 : 64;
+			job->hits = realloc(job->hits, sizeof(size_t) * job->cap);
+		}
+		job->hits[n++] = hit - chars;
+		p = hit + job->flen;
+	}
+	if (n == 0) return 0;
+
+	/* wlen may be shorter than flen, but the unsigned arithmetic wraps back to the right size. */
+	size_t size = len + n * (job->wlen - job->flen);
+	char *buf = malloc(size + 1);
+	char *q = buf;
+	size_t from = 0, i;
+	for (i = 0; i < n; i++) {
+		memcpy(q, &chars[from], job->hits[i] - from);
+		q += job->hits[i] - from;
+		memcpy(q, job->with, job->wlen);
+		q += job->wlen;
+		from = job->hits[i] + job->flen;
+	}
+	memcpy(q, &chars[from], len - from);
+	buf[size] = '\0';
+
+	/* only log what changed, from the start of the first match to the end of the last one. */
+	size_t first = job->hits[0], last = job->hits[n - 1] + job->flen;
+	size_t added = last - first + size - len;
+	undo_push(UNDO_DELETE, job->step, at, first, at, last, &chars[first], last - first);
+	undo_push(UNDO_INSERT, job->step, at, first, at, first + added, &buf[first], added);
+	rnode *node = row_isolate(at);
+	if (node->span == 0) free_row(&node->row);
+	row_init(&node->row, buf, size);
+	node->span = 0;
+	syntax_invalidate(at, 0, 0);
+	/* a search may have ruled the row out before. */
+	search_skip_reset();
+	E.dirty++;
+	return n;
+}
+
+void *replace_thread(void *arg)
+{
+	(void) arg;
+	replace_job *job = &E.replace;
+	struct timespec last = job->start;
+
+	pthread_mutex_lock(&E.lock);
+	while (job->row < E.numrows) {
+		size_t bytes = 0;
+		while (job->row < E.numrows && bytes < KILO_SCAN_BATCH) {
+			bytes += row_size(job->row) + 1;
+			job->count += row_replace(job, job->row);
+			/* the cursor may now be past the end of its row. */
+			size_t len = row_size(job->row);
+			if (job->row == E.cy && E.cx > len) E.cx = len;
+			job->row++;
+		}
+		if (elapsed_ms(&last) >= KILO_PROGRESS_MS) {
+			set_status_msg("Replacing... %d%%", (int) (job->row * 100 / E.numrows));
+			editor_wake();
+		}
+		worker_yield();
+	}
+
+	struct timespec start = job->start;
+	char count[48];
+	format_count(count, sizeof(count), job->count);
+	set_status_msg("Replaced %s occurrences in %ld ms", count, elapsed_ms(&start));
+	pthread_mutex_unlock(&E.lock);
+	editor_wake();
+	return NULL;
+}
+
+/* whether a replace is still running, which the file can't be edited during so it is undone in one go. */
+int replace_busy(void)
+{
+	if (!E.replace.active || E.replace.row >= E.numrows) return 0;
+	set_status_msg("A replace is still running");
+	return 1;
+}
+
+/* replace every occurrence of some text in the file, on a worker thread so large files don't freeze the editor. */
+void editor_replace(void)
+{
+	replace_job *job = &E.replace;
+	if (job->active) {
+		if (replace_busy()) return;
+		editor_unlock();
+		pthread_join(job->thread, NULL);
+		editor_lock();
+		job->active = 0;
+	}
+
+	char *find = editor_prompt("Replace: %s (ESC to cancel)", NULL);
+	if (find == NULL) return;
+	char *with = editor_prompt("With: %s (ESC to cancel)", NULL);
+	if (with == NULL) {
+		free(find);
+		return;
+	}
+
+	free(job->find);
+	free(job->with);
+	job->find = find;
+	job->flen = strlen(find);
+	job->with = with;
+	job->wlen = strlen(with);
+	job->row = 0;
+	job->count = 0;
+	job->step = E.undo.step;
+	clock_gettime(CLOCK_MONOTONIC, &job->start);
+	if (pthread_create(&job->thread, NULL, replace_thread, NULL) != 0) die("pthread_create");
+	job->active = 1;
+}
+
 /*** append buffer ***/
-/* Collect planned writes to a buffer to be written to STDOUT_FILENO all at once. */
+/* Collect planned writes to a buffer to be written to STDOUT_FILENO all at once.
+ * The buffer doubles when it runs out of room and is reused from frame to frame,
+ * so once it is large enough appending never allocates.
+ */
 
-void ab_append(abuf *ab, const char *s, int len)
+void ab_append(abuf *ab, const char *s, size_t len)
 {
 	/* first make sure we have enough space. */
-	char *new = realloc(ab->b, ab->len + len);
-
-	if (new == NULL) return;
-	/* then append given string into new buffer. */
-	memcpy(&new[ab->len], s, len);
-	ab->b = new;
+	if (ab->len + len > ab->cap) {
+		size_t cap = ab->cap ? ab->cap : 1024;
+		while (cap < ab->len + len) cap *= 2;
+		char *new = realloc(ab->b, cap);
+		if (new == NULL) return;
+		ab->b = new;
+		ab->cap = cap;
+	}
+	/* then append given string into the buffer. */
+	memcpy(&ab->b[ab->len], s, len);
 	ab->len += len;
 }
 
+/* empty the buffer but keep its memory. */
+void ab_reset(abuf *ab)
+{
+	ab->len = 0;
+}
+
 void ab_free(abuf *ab)
 {
 	free(ab->b);
+	ab->b = NULL;
 	ab->len = 0;
+	ab->cap = 0;
+}
+
+/*** screen ***/
+/* The frame is drawn into an array of cells first. screen_flush() then compares it with
+ * the previous frame and only sends the cells that changed to the terminal.
+ */
+
+void screen_init(void)
+{
+	int n = (E.screenrows + 2) * E.screencols;
+	E.screen.chars = realloc(E.screen.chars, n);
+	E.screen.attrs = realloc(E.screen.attrs, n);
+	E.shadow.chars = realloc(E.shadow.chars, n);
+	E.shadow.attrs = realloc(E.shadow.attrs, n);
+	E.shadow_valid = 0;
+}
+
+/* write len characters of s to row y of the frame, starting at column x. */
+void screen_put(int y, int x, const char *s, int len, int attr)
+{
+	if (x >= E.screencols) return;
+	if (len > E.screencols - x) len = E.screencols - x;
+	memcpy(&E.screen.chars[y * E.screencols + x], s, len);
+	memset(&E.screen.attrs[y * E.screencols + x], attr, len);
+}
+
+/* blank row y of the frame from column x on. */
+void screen_clear(int y, int x)
+{
+	memset(&E.screen.chars[y * E.screencols + x], ' ', E.screencols - x);
+	memset(&E.screen.attrs[y * E.screencols + x], 0, E.screencols - x);
+}
+
+/* whether every character is printable ASCII, so byte i is also column i. */
+int chars_plain(const char *c, int len)
+{
+	int x;
+	for (x = 0; x < len; x++)
+		if ((unsigned char) c[x] < ' ' || (unsigned char) c[x] > '~') return 0;
+	return 1;
+}
+
+/* switch the terminal to attributes attr if it is not using them already. */
+void screen_attr(abuf *ab, int attr, int *cur)
+{
+	if (attr == *cur) return;
+
+	/* m command means select graphic rendition.
+	 * 0 resets all attributes, 7 means invert colors, 30 to 37 pick the foreground color.
+	 */
+	char buf[16];
+	int color = attr & ~ATTR_INVERSE;
+	int len;
+	if (color)
+		len = snprintf(buf, sizeof(buf), "\x1b[0%s;%dm", (attr & ATTR_INVERSE) ? ";7" : "", color);
+	else
+		len = snprintf(buf, sizeof(buf), "\x1b[0%sm", (attr & ATTR_INVERSE) ? ";7" : "");
+	ab_append(ab, buf, len);
+	*cur = attr;
+}
+
+/* H command positions the cursor at [row;colH. */
+void screen_move(abuf *ab, int y, int x)
+{
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+	ab_append(ab, buf, len);
+}
+
+/* append what it takes to turn the shadow frame into the new one to ab.
+ * Returns 0 if the two were already the same.
+ */
+int screen_flush(abuf *ab)
+{
+	int rows = E.screenrows + 2;
+	int cols = E.screencols;
+	int changed = 0;
+	int attr = -1;			/* attributes the terminal is using, -1 if unknown. */
+	int cur_y = -1, cur_x = -1;	/* where the terminal's cursor is, -1 if unknown. */
+
+	if (!E.shadow_valid) {
+		/* l and h commands hide and show the cursor respectively. */
+		ab_append(ab, "\x1b[?25l", 6);
+		/* J means to erase in display, the argument 2 means clear the entire screen.
+		 * After that the terminal is blank, so that is what the shadow frame holds.
+		 */
+		ab_append(ab, "\x1b[m\x1b[2J", 7);
+		attr = 0;
+		memset(E.shadow.chars, ' ', rows * cols);
+		memset(E.shadow.attrs, 0, rows * cols);
+		E.shadow_valid = 1;
+		changed = 1;
+	}
+
+/* whether cell i of the current row is the same in both frames. */
+#define SAME(i) (nc[i] == oc[i] && na[i] == oa[i])
+
+	int y;
+	for (y = 0; y < rows; y++) {
+		char *nc = &E.screen.chars[y * cols];
+		char *oc = &E.shadow.chars[y * cols];
+		unsigned char *na = &E.screen.attrs[y * cols];
+		unsigned char *oa = &E.shadow.attrs[y * cols];
+		if (memcmp(nc, oc, cols) == 0 && memcmp(na, oa, cols) == 0) continue;
+		if (!changed) {
+			ab_append(ab, "\x1b[?25l", 6);
+			changed = 1;
+		}
+
+		/* bytes outside printable ASCII may not take up exactly one column each,
+		 * so a row holding any of them is rewritten from its start.
+		 */
+		int whole = !chars_plain(nc, cols) || !chars_plain(oc, cols);
+		int first = 0, last = cols - 1;
+		if (!whole) {
+			while (SAME(first)) first++;
+			while (SAME(last)) last--;
+		}
+
+		/* a blank end of the row is erased with a single escape sequence. */
+		int blank = cols;
+		while (blank > first && nc[blank - 1] == ' ' && na[blank - 1] == 0) blank--;
+
+		int x = first;
+		while (x <= last && x < blank) {
+			/* jump over unchanged cells, unless rewriting them is shorter than moving the cursor. */
+			if (!whole && SAME(x)) {
+				int gap = x;
+				while (gap <= last && gap < blank && SAME(gap)) gap++;
+				if (gap - x > 8) {
+					x = gap;
+					continue;
+				}
+			}
+
+			/* collect the run of cells with the same attributes that can be written in one go. */
+			int end = x + 1;
+			while (end <= last && end < blank && na[end] == na[x]) {
+				if (!whole && SAME(end)) {
+					int gap = end;
+					while (gap <= last && gap < blank && SAME(gap)) gap++;
+					if (gap - end > 8 || gap > last || gap >= blank) break;
+				}
+				end++;
+			}
+
+			if (cur_y != y || cur_x != x) screen_move(ab, y, x);
+			screen_attr(ab, na[x], &attr);
+			ab_append(ab, &nc[x], end - x);
+			cur_y = y;
+			/* the cursor position is uncertain once the last column is written. */
+			cur_x = (end < cols) ? end : -1;
+			x = end;
+		}
+
+		if (last >= blank) {
+			if (cur_y != y || cur_x != blank) screen_move(ab, y, blank);
+			cur_y = y;
+			cur_x = blank;
+			screen_attr(ab, 0, &attr);
+			/* K command erases the current line.
+			 * Default argument (0) erases to the right of the cursor.
+			 */
+			ab_append(ab, "\x1b[K", 3);
+		}
+
+		memcpy(oc, nc, cols);
+		memcpy(oa, na, cols);
+	}
+
+#undef SAME
+
+	if (changed && attr != 0) ab_append(ab, "\x1b[m", 3);
+	return changed;
 }
 
 /*** output ***/
 
 void refresh_screen(void)
 {
+#ifdef KILO_DEBUG
+	size_t allocs = alloc_count;
+#endif
+	long long frame_start = prof_begin();
 	editor_scroll();	/* figure out which row of the file we are currently on. */
 
-	abuf ab = ABUF_INIT;
+	/* draw the whole frame, then only send the terminal what changed since the last one. */
+	long long start = prof_begin();
+	draw_rows();
+	prof_end(PROF_DRAW_ROWS, start, 0);
+	draw_status();
+	draw_status_msg();
 
-	ab_append(&ab, "\x1b[?25l", 6);	/* l and h commands hide and show the cursor respectively. */
+	abuf *ab = &E.out;
+	ab_reset(ab);
+	int changed = screen_flush(ab);
 
-	/* Write an escape sequence to the terminal.
-	 * We are using VT100 escape sequences here.
-	 * \x1b is the escape character (27 in decimal).
-	 * Escape sequences are always the escape character followed by [
-	 * J means to erase in display.
-	 * The argument 2 to the J command means clear the entire screen.
-	 */
-	/* ab_append(&ab, "\x1b[2J", 4); */ 	/* clear the screen */
-	/* H command means to position the cursor.
+	/* Escape sequences are always the escape character (\x1b) followed by [.
+	 * H command means to position the cursor.
 	 * Normally takes two arguments [row;colH for (row, col).
 	 */
-	ab_append(&ab, "\x1b[H", 3);	/* reposition the cursor to position 1;1 */
+	screen_move(ab, E.cy - E.rowoff, E.rx - E.coloff);
 
-	draw_rows(&ab);
-	draw_status(&ab);
-	draw_status_msg(&ab);
+	if (changed) ab_append(ab, "\x1b[?25h", 6);
+	E.frame_bytes = ab->len;
+
+#ifdef KILO_BENCH
+	/* end the frame with a mark for bench/bench: the input it answers, how many bytes it took, and whether a
+	 * search, replace or save is still going on in the background.
+	 */
+	int busy = E.save.pid != 0 || (E.matches.active && !E.matches.done) || (E.replace.active && E.replace.row < E.numrows);
+	char mark[64];
+	int marklen = snprintf(mark, sizeof(mark), "\x1b_kilo;%zu;%zu;%d\x1b\\", E.input_bytes, E.frame_bytes, busy);
+	ab_append(ab, mark, marklen);
+#endif
+	start = prof_begin();
+	write(STDOUT_FILENO, ab->b, ab->len);
+	prof_end(PROF_WRITE, start, 0);
+#ifdef KILO_DEBUG
+	E.frame_allocs = alloc_count - allocs;
+#endif
+	prof_end(PROF_FRAME, frame_start, E.frame_bytes);
+}
 
+int get_cursor_pos(int *rows, int *cols)
+{
 	char buf[32];
-	snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
-	ab_append(&ab, buf, strlen(buf));
+	unsigned int i = 0;
+	/* n command used to query the terminal for status information.
+	 * 6 argument asks for cursor position.
+	 */
+	if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
+
+	printf("\r\n");
+	/* reply is an escape sequence of the form \x1b[row;colR. */
+	while (i < sizeof(buf) - 1) {
+		if (read(STDIN_FILENO, &buf[i], 1) != 1) break;
+		if (buf[i] == 'R') break;
+		i++;
+	}
+	buf[i] = '\0';
+
+	if (buf[0] != '\x1b' || buf[1] != '[') return -1;
+	/* parse the reply position with sscanf. */
+	if (sscanf(&buf[2], "%d;%d", rows, cols) != 2) return -1;
+
+	return 0;
+}
+
+int get_windowsize(int *rows, int *cols)
+{
+	struct winsize ws;
+
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+		/* C command moves cursor forward.
+		 * B command moves cursor down.
+		 * Both commands stop cursor from going past edge of screen, so we use 999.
+		 */
+		if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) return -1;
+		return get_cursor_pos(rows, cols);
+	} else {
+		*cols = ws.ws_col;
+		*rows = ws.ws_row;
+		return 0;
+	}
+}
+
+void editor_scroll(void)
+{
+	E.rx = 0;
+	if (E.cy < E.numrows) E.rx = row_cx_to_rx(row_at(E.cy), E.cx);
+
+	if (E.cy < E.rowoff) {
+		E.rowoff = E.cy;
+	}
+	if (E.cy >= E.rowoff + E.screenrows) {
+		E.rowoff = E.cy - E.screenrows + 1;
+	}
+	if (E.rx < E.coloff) {
+		E.coloff = E.rx;
+	}
+	if (E.rx >= E.coloff + E.screencols) {
+		E.coloff = E.rx - E.screencols + 1;
+	}
+}
+
+void draw_rows(void)
+{
+	int y;
+	for (y = 0; y < E.screenrows; y++) {
+		size_t filerow = y + E.rowoff;
+		screen_clear(y, 0);
+		if (filerow >= E.numrows) {
+			if (E.numrows == 0 && y == E.screenrows / 3) {
+				char welcome[80];
+				int welcomelen = snprintf(welcome, sizeof(welcome), "Kilo editor -- version %s", KILO_VERSION);
+				if (welcomelen > E.screencols) welcomelen = E.screencols;
+				int padding = (E.screencols - welcomelen) / 2;
+				if (padding) screen_put(y, 0, "~", 1, 0);
+				screen_put(y, padding, welcome, welcomelen, 0);
+			} else {
+				screen_put(y, 0, "~", 1, 0);
+			}
+		} else {
+			erow *row = row_at(filerow);
+			row_render(row, syntax_state_before(filerow), E.coloff, E.coloff + E.screencols);
+			size_t rend = row->rx0 + row->rsize;
+			size_t avail = rend > E.coloff ? rend - E.coloff : 0;
+			int len = avail < (size_t) E.screencols ? (int) avail : E.screencols;
+			if (len == 0) continue;
+			char *c = &row->render[E.coloff - row->rx0];
+			unsigned char *hl = &row->hl[E.coloff - row->rx0];
+
+			/* the match the search prompt is on is drawn over the highlighting, from m0 up to m1. */
+			int m0 = len, m1 = len;
+			match_table *mt = &E.matches;
+			if (mt->cur_len && filerow == mt->cur_row) {
+				size_t rx = row_cx_to_rx(row, mt->cur_col);
+				size_t rx_end = row_cx_to_rx(row, mt->cur_col + mt->cur_len);
+				if (rx < E.coloff + len && rx_end > E.coloff) {
+					m0 = (rx > E.coloff) ? (int) (rx - E.coloff) : 0;
+					m1 = (rx_end < E.coloff + len) ? (int) (rx_end - E.coloff) : len;
+				}
+			}
+			int j = 0;
+			while (j < len) {
+				/* put every run of characters with the same highlighting in one go. */
+				int match = j >= m0 && j < m1;
+				int h = match ? HL_MATCH : hl[j];
+				int end = j + 1;
+				while (end < len && (end >= m0 && end < m1) == match && (match || hl[end] == h)) end++;
+				int color = (h == HL_NORMAL) ? 0 : syntax_to_color(h);
+				screen_put(y, j, &c[j], end - j, color);
+				j = end;
+			}
+		}
+	}
+}
+
+void draw_status(void)
+{
+	/* the status bar is drawn with inverted colors. */
+	int y = E.screenrows;
+	char status[80], rstatus[160];
+	int len = snprintf(status, sizeof(status), "%.20s - %zu lines %s",
+			E.filename ? E.filename : "[No Name]", E.numrows,
+			E.dirty ? "(modified)" : "");
+	int rlen = match_status(rstatus, sizeof(rstatus));
+	rlen += prof_status(&rstatus[rlen], sizeof(rstatus) - rlen);
+#ifdef KILO_DEBUG
+	rlen += snprintf(&rstatus[rlen], sizeof(rstatus) - rlen, "%zu allocs %s | %zu/%zu", E.frame_allocs,
+			E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
+#else
+	rlen += snprintf(&rstatus[rlen], sizeof(rstatus) - rlen, "%s | %zu/%zu",
+			E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
+#endif
+	if (len > E.screencols) len = E.screencols;
+	screen_put(y, 0, status, len, ATTR_INVERSE);
+	while (len < E.screencols) {
+		if (E.screencols - len == rlen) {
+			screen_put(y, len, rstatus, rlen, ATTR_INVERSE);
+			break;
+		} else {
+			screen_put(y, len, " ", 1, ATTR_INVERSE);
+			len++;
+		}
+	}
+}
+
+void set_status_msg(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
+	va_end(ap);
+	E.statusmsg_time = time(NULL);
+}
+
+void draw_status_msg(void)
+{
+	int y = E.screenrows + 1;
+	screen_clear(y, 0);
+	int msglen = strlen(E.statusmsg);
+	if (msglen > E.screencols) msglen = E.screencols;
+	if(msglen && time(NULL) - E.statusmsg_time < 5)	/* set timeout to 5 seconds. */
+		screen_put(y, 0, E.statusmsg, msglen, 0);
+}
+
+/*** syntax highlighting ***/
+
+int is_separator(int c)
+{
+	return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+/* whether the n characters of str are at i in t. */
+int text_match(lex_text *t, size_t i, const char *str, size_t n)
+{
+	if (i + n > t->len) return 0;
+	if (i + n <= t->gap) return memcmp(&t->s[i], str, n) == 0;
+	if (i >= t->gap) return memcmp(&t->s[i + t->gaplen], str, n) == 0;
+	size_t j;
+	for (j = 0; j < n; j++)
+		if (TEXT_AT(t, i + j) != str[j]) return 0;
+	return 1;
+}
+
+/* lex t from i on, starting in pos, up to the first token that starts at or after stop, and return where that is.
+ * pos is left as it is there. If hl is not NULL it is filled in with the highlighting of every character lexed,
+ * hl[0] being that of i, which may run a little past stop but never more than KILO_LEX_REACH.
+ */
+size_t syntax_lex_span(lex_text *t, size_t i, size_t stop, lex_pos *pos, unsigned char *hl)
+{
+	struct editor_syntax *syntax = E.syntax;
+	size_t from = i;
+	size_t len = t->len;
+	if (stop > len) stop = len;
+
+	if (syntax == NULL) {
+		/* files in no known language only get their digits highlighted. */
+		pos->state = LEX_NORMAL;
+		for (; hl && i < stop; i++) hl[i - from] = isdigit((unsigned char) TEXT_AT(t, i)) ? HL_NUMBER : HL_NORMAL;
+		return stop;
+	}
+
+	char **keywords = syntax->keywords;
+	char *scs = syntax->singleline_comment_start;
+	char *mcs = syntax->multiline_comment_start;
+	char *mce = syntax->multiline_comment_end;
+	size_t scs_len = scs ? strlen(scs) : 0;
+	size_t mcs_len = mcs ? strlen(mcs) : 0;
+	size_t mce_len = mce ? strlen(mce) : 0;
+
+	while (i < stop) {
+		unsigned char c = TEXT_AT(t, i);
+		int number = pos->number;
+		pos->number = 0;
+
+		if (pos->state == LEX_LINE_COMMENT) {
+			if (hl) memset(&hl[i - from], HL_COMMENT, stop - i);
+			i = stop;
+			continue;
+		}
+
+		if (pos->state == LEX_COMMENT) {
+			if (mce_len && c == (unsigned char) mce[0] && text_match(t, i, mce, mce_len)) {
+				if (hl) memset(&hl[i - from], HL_MLCOMMENT, mce_len);
+				i += mce_len;
+				pos->state = LEX_NORMAL;
+				pos->prev_sep = 1;
+			} else {
+				if (hl) hl[i - from] = HL_MLCOMMENT;
+				i++;
+			}
+			continue;
+		}
+
+		if (pos->state == LEX_DQUOTE || pos->state == LEX_SQUOTE) {
+			if (hl) hl[i - from] = HL_STRING;
+			if (c == '\\') {
+				/* the escaped character is part of the string whatever it is. */
+				if (i + 1 == len) pos->escaped = 1;
+				else if (hl) hl[i + 1 - from] = HL_STRING;
+				i += 2;
+				continue;
+			}
+			if (c == (pos->state == LEX_DQUOTE ? '"' : '\'')) pos->state = LEX_NORMAL;
+			i++;
+			pos->prev_sep = 1;
+			continue;
+		}
+
+		if (scs_len && c == (unsigned char) scs[0] && text_match(t, i, scs, scs_len)) {
+			pos->state = LEX_LINE_COMMENT;
+			continue;
+		}
+
+		if (mcs_len && c == (unsigned char) mcs[0] && text_match(t, i, mcs, mcs_len)) {
+			if (hl) memset(&hl[i - from], HL_MLCOMMENT, mcs_len);
+			i += mcs_len;
+			pos->state = LEX_COMMENT;
+			continue;
+		}
+
+		if ((syntax->flags & HL_HIGHLIGHT_STRINGS) && (c == '"' || c == '\'')) {
+			if (hl) hl[i - from] = HL_STRING;
+			pos->state = (c == '"') ? LEX_DQUOTE : LEX_SQUOTE;
+			i++;
+			continue;
+		}
+
+		/* numbers and keywords never carry over to the next row, so they are only looked for when highlighting. */
+		if (hl && (syntax->flags & HL_HIGHLIGHT_NUMBERS)) {
+			if ((isdigit(c) && (pos->prev_sep || number)) || (c == '.' && number)) {
+				hl[i - from] = HL_NUMBER;
+				i++;
+				pos->prev_sep = 0;
+				pos->number = 1;
+				continue;
+			}
+		}
+
+		if (hl && pos->prev_sep) {
+			int j;
+			for (j = 0; keywords[j]; j++) {
+				size_t klen = strlen(keywords[j]);
+				int kw2 = keywords[j][klen - 1] == '|';
+				if (kw2) klen--;
+				if (c == (unsigned char) keywords[j][0] && text_match(t, i, keywords[j], klen) &&
+						(i + klen == len || is_separator((unsigned char) TEXT_AT(t, i + klen)))) {
+					memset(&hl[i - from], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
+					i += klen;
+					break;
+				}
+			}
+			if (keywords[j] != NULL) {
+				pos->prev_sep = 0;
+				continue;
+			}
+		}
+
+		if (hl) hl[i - from] = HL_NORMAL;
+		pos->prev_sep = is_separator(c);
+		i++;
+	}
+	return (i > len) ? len : i;
+}
+
+/* the lex_state the next row starts in, after one that was lexed to its end in pos. */
+int syntax_lex_end(lex_pos *pos)
+{
+	/* a string only goes on to the next row if the row ends in a backslash, a single line comment never does. */
+	if ((pos->state == LEX_DQUOTE || pos->state == LEX_SQUOTE) && !pos->escaped) return LEX_NORMAL;
+	if (pos->state == LEX_LINE_COMMENT) return LEX_NORMAL;
+	return pos->state;
+}
 
-	ab_append(&ab, "\x1b[?25h", 6);
+/* lex the len characters of s, starting in state, and return the lex_state at their end.
+ * If hl is not NULL it is filled in with the highlighting of every character.
+ */
+int syntax_lex(const char *s, size_t len, int state, unsigned char *hl)
+{
+	lex_text t = {s, len, len, 0};
+	lex_pos pos = {state, 1, 0, 0};
+	syntax_lex_span(&t, 0, len, &pos, hl);
+	return syntax_lex_end(&pos);
+}
 
-	write(STDOUT_FILENO, ab.b, ab.len);
-	ab_free(&ab);
+/* make room in hl_state for the states of the first n rows. */
+void syntax_reserve(size_t n)
+{
+	if (n <= E.hl_cap) return;
+	while (E.hl_cap < n) E.hl_cap = E.hl_cap ? E.hl_cap * 2 : 1024;
+	E.hl_state = realloc(E.hl_state, E.hl_cap);
 }
 
-int get_cursor_pos(int *rows, int *cols)
+/* lex row at, which starts in state, and return the lex_state at its end. */
+int syntax_lex_row(size_t at, int state)
 {
-	char buf[32];
-	unsigned int i = 0;
-	/* n command used to query the terminal for status information.
-	 * 6 argument asks for cursor position.
-	 */
-	if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
+	lex_text t;
+	row_read(at, &t);
+	lex_pos pos = {state, 1, 0, 0};
+	syntax_lex_span(&t, 0, t.len, &pos, NULL);
+	return syntax_lex_end(&pos);
+}
 
-	printf("\r\n");
-	/* reply is an escape sequence of the form \x1b[row;colR. */
-	while (i < sizeof(buf) - 1) {
-		if (read(STDIN_FILENO, &buf[i], 1) != 1) break;
-		if (buf[i] == 'R') break;
-		i++;
+/* Lex on in the row at hl_valid for about budget chars, from where hl_lex says the last call got to, and
+ * return the chars lexed plus one once the row is done. A row that was drawn in the state it starts in
+ * knows the state it ends in already. Relexing after an edit stops at the first row that ends in the same
+ * state as it did before.
+ */
+size_t syntax_lex_next(size_t budget)
+{
+	size_t k = E.hl_valid;
+	int state = k ? E.hl_state[k - 1] : LEX_NORMAL;
+	size_t start, lexed = 0;
+	rnode *node = rope_find(k, &start);
+	if (node->span == 0 && node->row.hl && node->row.hl_in == state) {
+		state = node->row.hl_out;
+	} else {
+		lex_text t;
+		row_read(k, &t);
+		lex_mark *m = &E.hl_lex;
+		if (m->at == 0) {
+			m->pos.state = state;
+			m->pos.prev_sep = 1;
+			m->pos.number = 0;
+			m->pos.escaped = 0;
+		}
+		size_t from = m->at;
+		size_t stop = t.len - from > budget ? from + budget : t.len;
+		m->at = syntax_lex_span(&t, from, stop, &m->pos, NULL);
+		lexed = m->at - from;
+		if (m->at < t.len) return lexed;
+		m->at = 0;
+		state = syntax_lex_end(&m->pos);
 	}
-	buf[i] = '\0';
 
-	if (buf[0] != '\x1b' || buf[1] != '[') return -1;
-	/* parse the reply position with sscanf. */
-	if (sscanf(&buf[2], "%d;%d", rows, cols) != 2) return -1;
+	if (k < E.hl_known && E.hl_state[k] == state) {
+		/* the rows below start out the same as they did before the edit, so they are right again. */
+		E.hl_valid = E.hl_known;
+		return lexed + 1;
+	}
+	syntax_reserve(k + 1);
+	E.hl_state[k] = state;
+	E.hl_valid = k + 1;
+	if (E.hl_known < E.hl_valid) E.hl_known = E.hl_valid;
+	return lexed + 1;
+}
 
-	return 0;
+/* the lex_state the row after at starts in, if at starts in state. A row that was drawn in that state knows it already,
+ * any other is lexed if it fits in what is left of *budget, or else is taken to end in LEX_NORMAL.
+ */
+int syntax_state_after(size_t at, int state, size_t *budget)
+{
+	size_t start;
+	rnode *node = rope_find(at, &start);
+	if (node->span == 0 && node->row.hl && node->row.hl_in == state) return node->row.hl_out;
+	size_t len = row_size(at);
+	if (len > *budget) {
+		*budget = 0;
+		return LEX_NORMAL;
+	}
+	*budget -= len;
+	return syntax_lex_row(at, state);
 }
 
-int get_windowsize(int *rows, int *cols)
+/* Guess the lex_state row at starts in, for a screen far below the rows hl_thread() has got to.
+ * The first row on the screen is lexed from the nearest row above it whose state is known, even if
+ * only from before an edit, or else from LEX_NORMAL up to KILO_HL_RESYNC rows above it. The rows
+ * below it carry on from there, mostly from the states they were just drawn in. No more than
+ * KILO_SCAN_BATCH chars are lexed for a guess, past that it starts over from LEX_NORMAL.
+ */
+int syntax_guess_state(size_t at)
 {
-	struct winsize ws;
+	size_t budget = KILO_SCAN_BATCH;
+	if (E.hl_guess_row != NO_ROW && at >= E.hl_guess_row && at - E.hl_guess_row <= (size_t) E.screenrows) {
+		while (E.hl_guess_row < at) {
+			E.hl_guess_state = syntax_state_after(E.hl_guess_row, E.hl_guess_state, &budget);
+			E.hl_guess_row++;
+		}
+		return E.hl_guess_state;
+	}
 
-	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
-		/* C command moves cursor forward.
-		 * B command moves cursor down.
-		 * Both commands stop cursor from going past edge of screen, so we use 999.
-		 */
-		if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) return -1;
-		return get_cursor_pos(rows, cols);
-	} else {
-		*cols = ws.ws_col;
-		*rows = ws.ws_row;
-		return 0;
+	/* most comments close within a few rows, so this is only wrong inside a long one. */
+	size_t from = at, bytes = 0;
+	while (from > E.hl_known && at - from < KILO_HL_RESYNC) {
+		size_t len = row_size(from - 1);
+		if (bytes + len > KILO_SCAN_BATCH) break;
+		bytes += len + 1;
+		from--;
 	}
+	int state = LEX_NORMAL;
+	if (from > 0 && from <= E.hl_known && E.hl_state[from - 1] != LEX_UNKNOWN) state = E.hl_state[from - 1];
+	for (; from < at; from++) state = syntax_state_after(from, state, &budget);
+	E.hl_guess_row = at;
+	E.hl_guess_state = state;
+	return state;
 }
 
-void editor_scroll(void)
+/* return the lex_state row at starts in. The main thread lexes at most a screenful of rows, and
+ * KILO_SCAN_BATCH chars of them, to find out. A screen further down than that, or rows longer, are
+ * lexed first from a guess, and drawn again once hl_thread() has got there, so a keystroke never
+ * waits for the rest of the file or for a long row.
+ */
+int syntax_state_before(size_t at)
 {
-	E.rx = 0;
-	if (E.cy < E.numrows) E.rx = row_cx_to_rx(&E.row[E.cy], E.cx);
+	if (E.syntax == NULL) return LEX_NORMAL;
 
-	if (E.cy < E.rowoff) {
-		E.rowoff = E.cy;
-	}
-	if (E.cy >= E.rowoff + E.screenrows) {
-		E.rowoff = E.cy - E.screenrows + 1;
+	if (E.hl_valid < at && !E.hl_waiting && at - E.hl_valid <= (size_t) E.screenrows) {
+		size_t bytes = 0;
+		while (E.hl_valid < at && bytes < KILO_SCAN_BATCH) bytes += syntax_lex_next(KILO_SCAN_BATCH - bytes);
 	}
-	if (E.rx < E.coloff) {
-		E.coloff = E.rx;
-	}
-	if (E.rx >= E.coloff + E.screencols) {
-		E.coloff = E.rx - E.screencols + 1;
+	if (E.hl_valid < at) {
+		E.hl_waiting = 1;
+		pthread_cond_signal(&E.hl_cond);
+		return syntax_guess_state(at);
 	}
+	return at ? E.hl_state[at - 1] : LEX_NORMAL;
 }
 
-void draw_rows(abuf *ab)
+/* Lex the rows nobody has looked at yet, from the top of the file down so the rows above
+ * the screen are done first. Lexing a row needs the state the row above ended in, so one
+ * thread is all there is work for.
+ */
+void *hl_thread(void *arg)
 {
-	int y;
-	for (y = 0; y < E.screenrows; y++) {
-		int filerow = y + E.rowoff;
-		if (filerow >= E.numrows) {
-			if (E.numrows == 0 && y == E.screenrows / 3) {
-				char welcome[80];
-				int welcomelen = snprintf(welcome, sizeof(welcome), "Kilo editor -- version %s", KILO_VERSION);
-				if (welcomelen > E.screencols) welcomelen = E.screencols;
-				int padding = (E.screencols - welcomelen) / 2;
-				if (padding) {
-					ab_append(ab, "~", 1);
-					padding--;
-				}
-				while (padding--) ab_append(ab, " ", 1);
-				ab_append(ab, welcome, welcomelen);
-			} else {
-				ab_append(ab, "~", 1);
-			}
-		} else {
-			int len = E.row[filerow].rsize - E.coloff;
-			if (len < 0) len = 0;
-			if (len > E.screencols) len = E.screencols;
-			char *c = &E.row[filerow].render[E.coloff];
-			unsigned char *hl = &E.row[filerow].hl[E.coloff];
-			int current_color = -1;
-			int j;
-			for (j = 0; j < len; j++) {
-				if (hl[j] == HL_NORMAL) {
-					if (current_color != -1) {
-						ab_append(ab, "\x1b[39m", 5);
-						ab_append(ab, &c[j], 1);
-					}
-					ab_append(ab, &c[j], 1);
-				} else {
-					int color = syntax_to_color(hl[j]);
-					if (color != current_color) {
-						current_color = color;
-						char buf[16];
-						int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-						ab_append(ab, buf, clen);
-					}
-					ab_append(ab, &c[j], 1);
-				}
-			}
-			ab_append(ab, "\x1b[39m", 5);
+	(void) arg;
+
+	pthread_mutex_lock(&E.lock);
+	while (1) {
+		while (E.syntax == NULL || E.hl_valid >= E.numrows) pthread_cond_wait(&E.hl_cond, &E.lock);
+
+		/* a long row is lexed a slice at a time, letting the main thread in between. */
+		size_t bytes = 0;
+		while (E.syntax && E.hl_valid < E.numrows && bytes < KILO_SCAN_BATCH)
+			bytes += syntax_lex_next(KILO_SCAN_BATCH - bytes);
+		/* the main thread can highlight the screen by itself from here. */
+		if (E.hl_waiting && E.hl_valid + E.screenrows >= E.rowoff) {
+			E.hl_waiting = 0;
+			editor_wake();
 		}
-			/* K command erases the current line.
-			 * Default argument (0) erases to the right of the cursor.
-			 */
-			ab_append(ab, "\x1b[K", 3);
-			ab_append(ab, "\r\n", 2);
-		} 
+		worker_yield();
+	}
+	return NULL;
 }
 
-void draw_status(abuf *ab)
+/* Keep the marks of a long row right after removed chars at at were replaced by added ones, and render its window
+ * again. The row is lexed again from the last mark the edit can't reach back to, until it is at a mark past the
+ * edit in the same state as before, the marks from there on only move along.
+ */
+void row_patch(erow *row, size_t at, size_t removed, size_t added)
 {
-	/* m command means select graphic rendition.
-	 * 7 means invert colors.
-	 */
-	ab_append(ab, "\x1b[7m", 4);
-	char status[80], rstatus[80];
-	int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-			E.filename ? E.filename : "[No Name]", E.numrows,
-			E.dirty ? "(modified)" : "");
-	int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d", E.cy + 1, E.numrows);
-	if (len > E.screencols) len = E.screencols;
-	ab_append(ab, status, len);
-	while (len < E.screencols) {
-		if (E.screencols - len == rlen) {
-			ab_append(ab, rstatus, rlen);
+	long long start = prof_begin();
+	lex_text t = {row->chars, row->size, row->gap, row->gaplen};
+	size_t n = 0;
+	size_t k;
+
+	/* marks in the removed chars are gone, the ones after them move along. */
+	for (k = 0; k < row->nmarks; k++) {
+		lex_mark m = row->marks[k];
+		if (m.at >= at && m.at < at + removed) continue;
+		if (m.at >= at + removed) m.at += added - removed;
+		row->marks[n++] = m;
+	}
+
+	size_t first = 0;
+	while (first < n && row->marks[first].at + KILO_LEX_REACH <= at) first++;
+	lex_pos pos = {row->hl_in, 1, 0, 0};
+	if (first) pos = row->marks[first - 1].pos;
+
+	/* lex from there, marking the way, until it runs into an old mark in step. */
+	unsigned char hl[KILO_LEX_BLOCK + KILO_LEX_REACH];
+	lex_mark *found = NULL;
+	size_t nfound = 0;
+	size_t i = first ? row->marks[first - 1].at : 0;
+	size_t next = first;
+	int converged = 0;
+	while (1) {
+		size_t stop = i + KILO_LEX_BLOCK;
+		if (next < n && row->marks[next].at < stop) stop = row->marks[next].at;
+		i = syntax_lex_span(&t, i, stop, &pos, hl);
+		if (i >= row->size) break;
+
+		while (next < n && row->marks[next].at < i) next++;
+		if (next < n && row->marks[next].at == i && i >= at + added &&
+				memcmp(&row->marks[next].pos, &pos, sizeof(pos)) == 0) {
+			converged = 1;
 			break;
-		} else {
-			ab_append(ab, " ", 1);
-			len++;
 		}
+		if (next < n && row->marks[next].at == i) next++;
+		if ((nfound & (nfound - 1)) == 0) found = realloc(found, sizeof(lex_mark) * (nfound ? 2 * nfound : 1));
+		found[nfound].at = i;
+		found[nfound].pos = pos;
+		nfound++;
 	}
-	ab_append(ab, "\x1b[m", 3);
-	ab_append(ab, "\r\n", 2);
+	if (!converged) row->hl_out = syntax_lex_end(&pos);
+
+	/* the marks before where it started, the ones just found, then the old ones from where they came back into step. */
+	size_t kept = converged ? n - next : 0;
+	size_t total = first + nfound + kept;
+	if (total > n) row->marks = realloc(row->marks, sizeof(lex_mark) * total);
+	memmove(&row->marks[first + nfound], &row->marks[next], sizeof(lex_mark) * kept);
+	if (nfound) memcpy(&row->marks[first], found, sizeof(lex_mark) * nfound);
+	row->nmarks = total;
+	free(found);
+
+	row_window(row, row->rx0, row->rx0 + row->rsize);
+	prof_end(PROF_ROW_RENDER, start, 0);
 }
 
-void set_status_msg(const char *fmt, ...)
+/* the rows starting at at changed, removed rows being replaced by added new ones.
+ * Nothing is relexed here, that is left to syntax_state_before() when the rows are drawn.
+ */
+void syntax_invalidate(size_t at, size_t removed, size_t added)
 {
-	va_list ap;
-	va_start(ap, fmt);
-	vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
-	va_end(ap);
-	E.statusmsg_time = time(NULL);
+	if (E.syntax == NULL) return;
+	E.hl_guess_row = NO_ROW;
+
+	if (removed == 0 && added == 0 && at < E.hl_valid) {
+		/* a long row that was edited had its hl patched, so it already knows the state it ends in now. */
+		size_t start;
+		rnode *node = rope_find(at, &start);
+		erow *row = &node->row;
+		int state = at ? E.hl_state[at - 1] : LEX_NORMAL;
+		if (node->span == 0 && row->hl && row->hl_in == state) {
+			if (row->hl_out == E.hl_state[at]) return;
+			E.hl_state[at] = row->hl_out;
+			at++;
+		}
+	}
+
+	/* the row being lexed a slice at a time has to start over if it changed or the state it starts in may have. */
+	if (at <= E.hl_valid) E.hl_lex.at = 0;
+	size_t edit = E.hl_valid;	/* an earlier edit that hasn't been relexed yet, if it is below hl_known. */
+	if (removed != added && at < E.hl_known) {
+		/* move the states of the rows below the change along with their rows. */
+		size_t tail = (E.hl_known > at + removed) ? E.hl_known - at - removed : 0;
+		syntax_reserve(at + added + tail);
+		memmove(&E.hl_state[at + added], &E.hl_state[at + removed], tail);
+		memset(&E.hl_state[at], LEX_UNKNOWN, added);
+		E.hl_known = at + added + tail;
+		if (edit > at) edit = (edit >= at + removed) ? edit - removed + added : at;
+	}
+	/* only the rows between the first edit and the next one can be found to be right again. */
+	size_t last = (at > edit) ? at : edit;
+	if (E.hl_known > last) E.hl_known = last;
+	E.hl_valid = (at < edit) ? at : edit;
+	pthread_cond_signal(&E.hl_cond);
 }
 
-void draw_status_msg(abuf *ab)
+/* pick the language to highlight by the filename, and start highlighting over. */
+void select_syntax(void)
 {
-	ab_append(ab, "\x1b[K", 3);
-	int msglen = strlen(E.statusmsg);
-	if (msglen > E.screencols) msglen = E.screencols;
-	if(msglen && time(NULL) - E.statusmsg_time < 5)	/* set timeout to 5 seconds. */
-		ab_append(ab, E.statusmsg, msglen);
-}
+	E.syntax = NULL;
+	unsigned int j;
+	for (j = 0; E.filename && E.syntax == NULL && j < HLDB_ENTRIES; j++) {
+		struct editor_syntax *s = &HLDB[j];
+		char *ext = strrchr(E.filename, '.');
+		int i;
+		for (i = 0; s->filematch[i]; i++) {
+			int is_ext = (s->filematch[i][0] == '.');
+			if ((is_ext && ext && strcmp(ext, s->filematch[i]) == 0) ||
+					(!is_ext && strstr(E.filename, s->filematch[i]))) {
+				E.syntax = s;
+				break;
+			}
+		}
+	}
 
-/*** syntax highlighting ***/
+	E.hl_valid = 0;
+	E.hl_known = 0;
+	E.hl_lex.at = 0;
+	E.hl_guess_row = NO_ROW;
+	while (E.cache_tail) update_row(E.cache_tail);
+	pthread_cond_signal(&E.hl_cond);
+}
 
-void update_syntax(erow *row)
+/* lex the whole of a long row, which starts in state, leaving a mark every KILO_LEX_BLOCK chars or so that
+ * row_window() picks the lexing up again from. None of its hl is kept, so this takes much less memory than the
+ * row itself does.
+ */
+void syntax_mark_row(erow *row, int state)
 {
-	row->hl = realloc(row->hl, row->rsize);
-	memset(row->hl, HL_NORMAL, row->rsize);
+	free(row->marks);
+	row->marks = NULL;
+	row->nmarks = 0;
+	row->hl_in = state;
+	row->hl_out = state;
+	if (state == LEX_UNKNOWN) return;
 
-	int i;
-	for (i = 0; i < row->rsize; i++) {
-		if (isdigit(row->render[i])) {
-			row->hl[i] = HL_NUMBER;
-		}
+	lex_text t = {row->chars, row->size, row->gap, row->gaplen};
+	lex_pos pos = {state, 1, 0, 0};
+	unsigned char hl[KILO_LEX_BLOCK + KILO_LEX_REACH];
+	size_t i = 0;
+	while (1) {
+		i = syntax_lex_span(&t, i, i + KILO_LEX_BLOCK, &pos, hl);
+		if (i >= row->size) break;
+		if ((row->nmarks & (row->nmarks - 1)) == 0)
+			row->marks = realloc(row->marks, sizeof(lex_mark) * (row->nmarks ? 2 * row->nmarks : 1));
+		row->marks[row->nmarks].at = i;
+		row->marks[row->nmarks].pos = pos;
+		row->nmarks++;
 	}
+	row->hl_out = syntax_lex_end(&pos);
+}
+
+/* work out the highlighting of row, which starts in state. Rows starting in LEX_UNKNOWN aren't highlighted. */
+void update_syntax(erow *row, int state)
+{
+	long long start = prof_begin();
+	row->hl = realloc(row->hl, row->rsize);
+	if (state == LEX_UNKNOWN) memset(row->hl, HL_NORMAL, row->rsize);
+	else row->hl_out = syntax_lex(row->render, row->rsize, state, row->hl);
+	row->hl_in = state;
+	prof_end(PROF_UPDATE_SYNTAX, start, 0);
 }
 
 int syntax_to_color(int hl) {
 	switch(hl) {
+		case HL_COMMENT:
+		case HL_MLCOMMENT:
+			return 36;	/* cyan. */
+		case HL_KEYWORD1:
+			return 33;	/* yellow. */
+		case HL_KEYWORD2:
+			return 32;	/* green. */
+		case HL_STRING:
+			return 35;	/* magenta. */
 		case HL_NUMBER:
 			return 31;	/* red. */
 		case HL_MATCH:
@@ -799,7 +5259,13 @@ char *editor_prompt(char *prompt, void (*callback)(char *, int))
 
 	while (1) {
 		set_status_msg(prompt, buf);
-		refresh_screen();
+		/* only draw once all the keys that have already arrived are handled. */
+		if (!input_pending()) input_fill(0);
+		while (!input_pending()) {
+			refresh_screen();
+			input_wait();
+			if (callback && !input_pending()) callback(buf, PROMPT_IDLE);
+		}
 
 		int c = read_key();
 		if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
@@ -815,6 +5281,20 @@ char *editor_prompt(char *prompt, void (*callback)(char *, int))
 				if (callback) callback(buf, c);
 				return buf;
 			}
+		} else if (c == PASTE_START) {
+			/* only the printable characters of a paste make it into the prompt. */
+			size_t len, i;
+			char *text = read_paste(&len);
+			for (i = 0; i < len; i++) {
+				if (iscntrl(text[i]) || (unsigned char) text[i] >= 128) continue;
+				if (buflen == bufsize - 1) {
+					bufsize *= 2;
+					buf = realloc(buf, bufsize);
+				}
+				buf[buflen++] = text[i];
+			}
+			buf[buflen] = '\0';
+			free(text);
 		} else if (!iscntrl(c) && c < 128) {
 			if (buflen == bufsize - 1) {
 				bufsize *= 2;
@@ -831,11 +5311,19 @@ char *editor_prompt(char *prompt, void (*callback)(char *, int))
 void process_keypress(void)
 {
 	static int quit_times = KILO_QUIT_TIMES;
+	static int last_kind = 0;
 	int c = read_key();
 
+	/* a run of typed keys, or of deleting ones, is one step and is undone in one go. */
+	int kind = 0;
+	if (c >= ' ' && c < BACKSPACE) kind = 1;
+	else if (c == BACKSPACE || c == CTRL_KEY('h') || c == DEL_KEY) kind = 2;
+	if (kind == 0 || kind != last_kind) E.undo.step++;
+	last_kind = kind;
+
 	switch (c) {
 		case '\r':
-			insert_newline();
+			if (!replace_busy()) insert_newline();
 			break;
 		case CTRL_KEY('q'):
 			if (E.dirty && quit_times > 0) {
@@ -845,6 +5333,8 @@ void process_keypress(void)
 			}
 			write(STDOUT_FILENO, "\x1b[2J", 4);
 			write(STDOUT_FILENO, "\x1b[H", 3);
+			save_wait();
+			journal_remove();
 			exit(0);
 			break;
 		case CTRL_KEY('s'):
@@ -855,14 +5345,41 @@ void process_keypress(void)
 			break;
 		case END_KEY:
 			if (E.cy < E.numrows)
-				E.cx = E.row[E.cy].size;
+				E.cx = row_at(E.cy)->size;
 			break;
 		case CTRL_KEY('f'):
-			editor_find();
+			editor_find(0);
+			break;
+		case CTRL_KEY('g'):
+			editor_find(1);
+			break;
+		case CTRL_KEY('r'):
+			editor_replace();
+			break;
+		case CTRL_KEY('z'):
+			editor_undo();
+			break;
+		case CTRL_KEY('t'):
+			prof_toggle();
+			break;
+		case CTRL_KEY('e'):
+			editor_tabstop();
+			break;
+		case CTRL_KEY('y'):
+			editor_redo();
+			break;
+		case PASTE_START:
+			{
+				size_t len;
+				char *text = read_paste(&len);
+				if (!replace_busy()) insert_text(text, len);
+				free(text);
+			}
 			break;
 		case BACKSPACE:
 		case CTRL_KEY('h'):	/* CTRL-h sends ASCII code 8 which is what the backspace character used to send. */
 		case DEL_KEY:
+			if (replace_busy()) break;
 			if (c == DEL_KEY) move_cursor(ARROW_RIGHT);
 			delete_char();
 			break;
@@ -887,10 +5404,12 @@ void process_keypress(void)
 			move_cursor(c);
 			break;
 		case CTRL_KEY('l'):	/* CTRL-l traditionally used to refresh the screen in terminal programs. */
+			E.shadow_valid = 0;
+			break;
 		case '\x1b':
 			break;
 		default:
-			insert_char(c);
+			if (!replace_busy()) insert_char(c);
 			break;
 	}
 
@@ -900,7 +5419,7 @@ void process_keypress(void)
 void move_cursor(int key)
 {
 	/* get the current row. */
-	erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+	erow *row = row_at(E.cy);
 	
 	switch (key) {
 		case ARROW_LEFT:
@@ -908,7 +5427,7 @@ void move_cursor(int key)
 				E.cx--;
 			} else if (E.cy > 0) {
 				E.cy--;
-				E.cx = E.row[E.cy].size;
+				E.cx = row_at(E.cy)->size;
 			}
 			break;
 		case ARROW_RIGHT:
@@ -927,11 +5446,409 @@ void move_cursor(int key)
 			break;
 	}
 
-	row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
-	int rowlen = row ? row->size : 0;
+	row = row_at(E.cy);
+	size_t rowlen = row ? row->size : 0;
 	if (E.cx > rowlen) E.cx = rowlen;
 }
 
+/*** profiling ***/
+
+long long prof_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* the start of a span, 0 if nothing is being timed. */
+long long prof_begin(void)
+{
+	return E.prof.on ? prof_now() : 0;
+}
+
+/* end a span of kind that began at start, bytes is what a frame wrote. */
+void prof_end(int kind, long long start, size_t bytes)
+{
+	profiler *p = &E.prof;
+	if (start == 0) return;
+	long long dur = prof_now() - start;
+
+	if (kind == PROF_FRAME) {
+		p->frame_ns[p->nframes % KILO_PROF_FRAMES] = dur;
+		p->frame_bytes[p->nframes % KILO_PROF_FRAMES] = bytes;
+		p->nframes++;
+	}
+	if (p->spans == NULL) return;
+	prof_span *span = &p->spans[p->nspans++ % KILO_PROF_SPANS];
+	span->start = start - p->epoch;
+	span->dur = dur;
+	span->bytes = bytes;
+	span->kind = kind;
+	span->worker = !pthread_equal(pthread_self(), p->main);
+}
+
+/* record spans from now on, and write them to path as a Chrome trace on exit. */
+void prof_trace(char *path)
+{
+	profiler *p = &E.prof;
+	p->trace = path;
+	p->spans = malloc(sizeof(prof_span) * KILO_PROF_SPANS);
+	p->main = pthread_self();
+	p->epoch = prof_now();
+	p->on = 1;
+	atexit(prof_dump);
+}
+
+void prof_toggle(void)
+{
+	profiler *p = &E.prof;
+	p->hud = !p->hud;
+	p->on = p->hud || p->trace;
+	p->nframes = 0;
+	if (p->epoch == 0) {
+		p->main = pthread_self();
+		p->epoch = prof_now();
+	}
+}
+
+/* the readout for the status bar: the last frame's time, the slowest and the average size of recent ones. */
+int prof_status(char *buf, size_t size)
+{
+	profiler *p = &E.prof;
+	if (!p->hud || p->nframes == 0) return 0;
+
+	size_t n = p->nframes < KILO_PROF_FRAMES ? p->nframes : KILO_PROF_FRAMES;
+	long long last = p->frame_ns[(p->nframes - 1) % KILO_PROF_FRAMES], max = 0;
+	size_t bytes = 0, i;
+	for (i = 0; i < n; i++) {
+		if (p->frame_ns[i] > max) max = p->frame_ns[i];
+		bytes += p->frame_bytes[i];
+	}
+	return snprintf(buf, size, "%lld.%02lldms max %lld.%02lldms %zuB | ", last / 1000000, last / 10000 % 100,
+			max / 1000000, max / 10000 % 100, bytes / n);
+}
+
+/* write the recorded spans to the trace file, in the Chrome trace event format. */
+void prof_dump(void)
+{
+	profiler *p = &E.prof;
+	if (p->trace == NULL) return;
+	FILE *fp = fopen(p->trace, "w");
+	if (fp == NULL) return;
+
+	size_t i = p->nspans > KILO_PROF_SPANS ? p->nspans - KILO_PROF_SPANS : 0;
+	fprintf(fp, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+	for (; i < p->nspans; i++) {
+		prof_span *span = &p->spans[i % KILO_PROF_SPANS];
+		fprintf(fp, "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, \"tid\": %d, \"ts\": %lld.%03lld, \"dur\": %lld.%03lld",
+				prof_names[span->kind], (int) getpid(), span->worker ? 2 : 1,
+				span->start / 1000, span->start % 1000, span->dur / 1000, span->dur % 1000);
+		if (span->kind == PROF_FRAME) fprintf(fp, ", \"args\": {\"bytes\": %zu}", span->bytes);
+		fprintf(fp, "}%s\n", i + 1 < p->nspans ? "," : "");
+	}
+	fprintf(fp, "]}\n");
+	fclose(fp);
+	p->trace = NULL;
+}
+
+/*** batch ***/
+/* Run a script of edits on files without a terminal, kilo -b SCRIPT [-j JOBS] FILE...
+ * The script is read from SCRIPT, or from stdin if it is "-", and has one command a line:
+ *
+ *   goto ROW [COL]      move the cursor, counting from 1.
+ *   find TEXT           move the cursor to the next TEXT at or after it, the file is left alone if there is none.
+ *   insert TEXT         insert TEXT at the cursor.
+ *   newline             split the line at the cursor.
+ *   backspace [N]       delete N characters before the cursor.
+ *   delete [N]          delete N characters under the cursor.
+ *   deleteline [N]      delete N lines starting with the cursor's.
+ *   replace FIND WITH   replace every FIND in the file with WITH.
+ *
+ * TEXT may use \n, \t, \s for a space and \\. Empty lines and lines starting with '#' are skipped.
+ * Files are edited in parallel, each by a process of its own, and written back only if they changed.
+ */
+
+/* turn the escapes in s into the characters they stand for, and return its new length. */
+size_t batch_unescape(char *s)
+{
+	size_t i, j = 0;
+	for (i = 0; s[i]; i++) {
+		if (s[i] == '\\' && s[i + 1]) {
+			i++;
+			switch (s[i]) {
+				case 'n': s[j++] = '\n'; break;
+				case 't': s[j++] = '\t'; break;
+				case 's': s[j++] = ' '; break;
+				default: s[j++] = s[i]; break;
+			}
+		} else {
+			s[j++] = s[i];
+		}
+	}
+	s[j] = '\0';
+	return j;
+}
+
+/* move the cursor to the next text at or after it. */
+const char *batch_find(const char *text)
+{
+	size_t tlen = strlen(text);
+	size_t at, from = E.cx;
+	for (at = E.cy; at < E.numrows; at++) {
+		lex_text t;
+		row_read(at, &t);
+		size_t hit = text_find(&t, from, t.len, text, tlen);
+		if (hit != NO_ROW) {
+			E.cy = at;
+			E.cx = hit;
+			return NULL;
+		}
+		from = 0;
+	}
+	return "not found";
+}
+
+/* run a line of a script, return NULL if it worked or what went wrong. */
+const char *batch_command(char *line)
+{
+	char *cmd = line;
+	char *arg = strchr(line, ' ');
+	if (arg) *arg++ = '\0';
+	else arg = "";
+	long n = 1;
+	if (*arg && (strcmp(cmd, "backspace") == 0 || strcmp(cmd, "delete") == 0 || strcmp(cmd, "deleteline") == 0)) {
+		n = strtol(arg, NULL, 10);
+		if (n < 0) return "bad count";
+	}
+
+	if (strcmp(cmd, "goto") == 0) {
+		char *end;
+		long row = strtol(arg, &end, 10);
+		long col = strtol(end, NULL, 10);
+		if (row < 1) return "bad row";
+		E.cy = ((size_t) row - 1 < E.numrows) ? (size_t) row - 1 : E.numrows;
+		E.cx = (col > 1) ? (size_t) col - 1 : 0;
+	} else if (strcmp(cmd, "find") == 0) {
+		batch_unescape(arg);
+		if (*arg == '\0') return "nothing to find";
+		const char *err = batch_find(arg);
+		if (err) return err;
+	} else if (strcmp(cmd, "insert") == 0) {
+		size_t len = batch_unescape(arg);
+		insert_text(arg, len);
+	} else if (strcmp(cmd, "newline") == 0) {
+		insert_newline();
+	} else if (strcmp(cmd, "backspace") == 0) {
+		while (n-- > 0) delete_char();
+	} else if (strcmp(cmd, "delete") == 0) {
+		while (n-- > 0) {
+			move_cursor(ARROW_RIGHT);
+			delete_char();
+		}
+	} else if (strcmp(cmd, "deleteline") == 0) {
+		delete_rows(E.cy, n);
+		E.cx = 0;
+	} else if (strcmp(cmd, "replace") == 0) {
+		char *with = strchr(arg, ' ');
+		if (with == NULL) return "replace needs FIND and WITH";
+		*with++ = '\0';
+		replace_job *job = &E.replace;
+		job->find = arg;
+		job->flen = batch_unescape(arg);
+		job->with = with;
+		job->wlen = batch_unescape(with);
+		if (job->flen == 0) return "nothing to find";
+		size_t at;
+		for (at = 0; at < E.numrows; at++) job->count += row_replace(job, at);
+		job->find = job->with = NULL;
+	} else {
+		return "unknown command";
+	}
+
+	/* keep the cursor on the text, the way moving it by hand does. */
+	if (E.cy > E.numrows) E.cy = E.numrows;
+	size_t len = E.cy < E.numrows ? row_size(E.cy) : 0;
+	if (E.cx > len) E.cx = len;
+	return NULL;
+}
+
+/* run the n lines of a script on file and write it back, return 0 if that all worked. */
+int batch_file(const char *file, char **script, size_t n)
+{
+	init_editor();
+	editor_open((char *) file);
+
+	size_t i;
+	for (i = 0; i < n; i++) {
+		if (script[i][0] == '\0' || script[i][0] == '#') continue;
+		char *line = strdup(script[i]);
+		const char *err = batch_command(line);
+		free(line);
+		if (err) {
+			fprintf(stderr, "kilo: %s: line %zu: %s\n", file, i + 1, err);
+			return 1;
+		}
+	}
+	if (!E.dirty) return 0;
+
+	size_t namelen = strlen(E.filename);
+	char *tmp = malloc(namelen + 8);
+	snprintf(tmp, namelen + 8, "%s.XXXXXX", E.filename);
+	char *dir = dir_of(E.filename);
+	save_state state;
+	ssize_t len = save_write(tmp, dir, &state);
+	int err = errno;
+	free(tmp);
+	free(dir);
+	if (len == -1) {
+		fprintf(stderr, "kilo: %s: %s\n", file, strerror(err));
+		return 1;
+	}
+	return 0;
+}
+
+int batch_usage(void)
+{
+	fprintf(stderr, "Usage: kilo -b SCRIPT [-j JOBS] FILE...\n");
+	return 2;
+}
+
+/* kilo -b SCRIPT [-j JOBS] FILE..., return the exit status. */
+int batch_main(int argc, char **argv)
+{
+	if (argc < 2) return batch_usage();
+	const char *name = argv[0];
+	long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	int first = 1;
+	if (strcmp(argv[1], "-j") == 0) {
+		char *end;
+		if (argc < 4) return batch_usage();
+		jobs = strtol(argv[2], &end, 10);
+		if (end == argv[2] || *end != '\0' || jobs < 1) return batch_usage();
+		first = 3;
+	}
+	if (jobs < 1) jobs = 1;
+
+	/* read the whole script up front, every file gets a copy of it. */
+	FILE *fp = strcmp(name, "-") == 0 ? stdin : fopen(name, "r");
+	if (fp == NULL) {
+		perror(name);
+		return 2;
+	}
+	char **script = NULL;
+	size_t n = 0, cap = 0;
+	char *line = NULL;
+	size_t linecap = 0;
+	ssize_t linelen;
+	while ((linelen = getline(&line, &linecap, fp)) != -1) {
+		while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) line[--linelen] = '\0';
+		if (n == cap) {
+			cap = cap ? cap * 2 : 64;
+			script = realloc(script, sizeof(char *) * cap);
+		}
+		script[n++] = strdup(line);
+	}
+	free(line);
+	if (fp != stdin) fclose(fp);
+
+	E.batch = 1;
+	if (argc - first == 1) return batch_file(argv[first], script, n);
+
+	/* a process for every file, with at most jobs of them running at once. */
+	int status = 0, running = 0, i, st;
+	for (i = first; i < argc; i++) {
+		if (running == jobs) {
+			if (wait(&st) > 0 && !(WIFEXITED(st) && WEXITSTATUS(st) == 0)) status = 1;
+			running--;
+		}
+		pid_t pid = fork();
+		if (pid == 0) _exit(batch_file(argv[i], script, n));
+		if (pid == -1) {
+			perror("fork");
+			status = 1;
+			continue;
+		}
+		running++;
+	}
+	while (running-- > 0)
+		if (wait(&st) > 0 && !(WIFEXITED(st) && WEXITSTATUS(st) == 0)) status = 1;
+	return status;
+}
+
+/*** bench ***/
+
+#ifdef KILO_BENCH
+/* bytes per nanosecond, which is GB/s, to go through len bytes in the time since start. */
+double bench_gbps(size_t len, struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double ns = (now.tv_sec - start->tv_sec) * 1e9 + (now.tv_nsec - start->tv_nsec);
+	return ns > 0 ? len / ns : 0;
+}
+
+/* GB/s of finding all the matches of query in the rows of the file. */
+double bench_search(const char *query, int regex)
+{
+	search_set(query, regex);
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	size_t at, bytes = 0;
+	for (at = 0; at < E.numrows; at++) {
+		size_t col, mlen;
+		lex_text t;
+		row_read(at, &t);
+		search_scan_reset(&E.search.scan, t.len);
+		while (search_row(&E.search.scan, &t, &col, &mlen));
+		bytes += t.len + 1;
+	}
+	double gbps = bench_gbps(bytes, &start);
+	search_clear();
+	return gbps;
+}
+
+/* kilo -s FILE, used by bench/bench: print how fast the lines of FILE are indexed on 1, 2, 4 and 8 threads,
+ * in GB/s and the best of a few tries, one "index THREADS GBPS" line each. Then how fast all the matches of
+ * some text are found in it, and those of a regex, on one thread.
+ */
+int bench_main(int argc, char **argv)
+{
+	if (argc < 1) {
+		fprintf(stderr, "Usage: kilo -s FILE\n");
+		return 2;
+	}
+	E.batch = 1;
+	init_editor();
+	editor_open(argv[0]);
+	if (E.mapsize == 0) {
+		fprintf(stderr, "kilo: %s is empty\n", argv[0]);
+		return 1;
+	}
+
+	/* read it all once first, so every try finds it in the page cache. */
+	size_t nlines;
+	free(index_lines(E.map, E.mapsize, 1, &nlines));
+
+	int nthreads;
+	for (nthreads = 1; nthreads <= KILO_INDEX_THREADS; nthreads *= 2) {
+		double best = 0;
+		int i;
+		for (i = 0; i < 3; i++) {
+			struct timespec start;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			free(index_lines(E.map, E.mapsize, nthreads, &nlines));
+			double gbps = bench_gbps(E.mapsize, &start);
+			if (gbps > best) best = gbps;
+		}
+		printf("index %d %.2f\n", nthreads, best);
+	}
+
+	printf("literal 1 %.2f\n", bench_search("= 4242;", 0));
+	printf("regex 1 %.2f\n", bench_search("= 4[0-9]*2;", 1));
+	return 0;
+}
+#endif
+
 /*** init ***/
 
 void init_editor(void)
@@ -941,29 +5858,113 @@ void init_editor(void)
 	E.rx = 0;
 	E.rowoff = 0;
 	E.numrows = 0;
-	E.row = NULL;
+	E.rows = NULL;
+	E.finger = NULL;
+	E.map = NULL;
+	E.mapsize = 0;
+	E.lines = NULL;
+	E.nlines = 0;
+	E.cache_head = NULL;
+	E.cache_tail = NULL;
+	E.cache_bytes = 0;
+	E.screen.chars = NULL;
+	E.screen.attrs = NULL;
+	E.shadow.chars = NULL;
+	E.shadow.attrs = NULL;
+	E.out.b = NULL;
+	E.out.len = 0;
+	E.out.cap = 0;
+	E.frame_bytes = 0;
+#ifdef KILO_DEBUG
+	E.frame_allocs = 0;
+#endif
+#ifdef KILO_BENCH
+	E.input_bytes = 0;
+#endif
 	E.dirty = 0;
 	E.filename = NULL;
+	E.syntax = NULL;
+	E.hl_state = NULL;
+	E.hl_cap = 0;
+	E.hl_valid = 0;
+	E.hl_known = 0;
+	E.hl_lex.at = 0;
+	E.hl_waiting = 0;
+	E.hl_guess_row = NO_ROW;
 	// E.statusmsg[0] = '\0';
 	E.statusmsg_time = 0;
 
-	if (get_windowsize(&E.screenrows, &E.screencols) == -1) die("get_windowsize");
-	E.screenrows -= 2;
+	E.inpos = 0;
+	E.inlen = 0;
+	E.winch = 0;
+	memset(&E.search, 0, sizeof(E.search));
+	memset(&E.matches, 0, sizeof(E.matches));
+	memset(&E.replace, 0, sizeof(E.replace));
+	memset(&E.save, 0, sizeof(E.save));
+	memset(&E.undo, 0, sizeof(E.undo));
+	E.undo.limit = KILO_UNDO_LIMIT;
+	memset(&E.journal, 0, sizeof(E.journal));
+	E.journal.fd = -1;
+	E.journal.next_fd = -1;
+	E.matches.cur_row = NO_ROW;
+	E.matches.cur_len = 0;
+	E.tabstop = KILO_TAB_STOP;
+
+	if (E.batch) {
+		/* there is no screen, but cursor movement still goes by a page of its size. */
+		E.screenrows = 24;
+		E.screencols = 80;
+		/* nothing can be undone, so keep no history. */
+		E.undo.replaying = 1;
+		return;
+	}
+	update_windowsize();
 }
 
 int main(int argc, char *argv[])
 {
+	pthread_mutex_init(&E.lock, NULL);
+	pthread_cond_init(&E.hl_cond, NULL);
+	/* until input_init() makes the self-pipe, there is no one to wake. */
+	E.wakefd[0] = -1;
+	E.wakefd[1] = -1;
+	if (argc >= 2 && strcmp(argv[1], "-b") == 0) return batch_main(argc - 2, &argv[2]);
+#ifdef KILO_BENCH
+	if (argc >= 2 && strcmp(argv[1], "-s") == 0) return bench_main(argc - 2, &argv[2]);
+#endif
+
 	raw_mode();
+	input_init();
+	/* init_editor may already have to wait for the terminal, which lets go of the lock. */
+	editor_lock();
 	init_editor();
+	/* kilo -t TRACE.json [FILE] writes a trace of where the time went when it exits. */
+	if (argc >= 3 && strcmp(argv[1], "-t") == 0) {
+		prof_trace(argv[2]);
+		argc -= 2;
+		argv += 2;
+	}
 	if (argc >= 2) {
 		editor_open(argv[1]);
 	}
+	pthread_create(&E.hl_thread, NULL, hl_thread, NULL);
+	pthread_cond_init(&E.journal.cond, NULL);
+	pthread_create(&E.journal.thread, NULL, journal_thread, NULL);
 
-	set_status_msg("HELP: CTRL-S to save | CTRL-Q to quit | CTRL-F to find.");
+	set_status_msg("HELP: CTRL-S save | CTRL-Q quit | CTRL-F find | CTRL-G regex | CTRL-R replace | CTRL-Z undo | "
+		"CTRL-Y redo | CTRL-E tab stop | CTRL-T timings");
+	journal_start();
 
 	while (1) {
 		refresh_screen();
-		process_keypress();
+		input_wait();
+		while (input_pending()) {
+			long long start = prof_begin();
+			process_keypress();
+			prof_end(PROF_KEYPRESS, start, 0);
+			/* keep going while more input is already waiting, so a burst of keys is drawn once. */
+			if (!input_pending()) input_fill(0);
+		}
 	}
 
 	return 0;